@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "macros.h"
+#include "library.h"
+#include "tree.h"
+#include "writer.h"
+#include "stats.h"
+#include "postings.h"
+
+/* Benchmark driver: times each stage of the catalogue lifecycle on the
+   given file and prints one JSON object per stage on stdout. */
+
+#define SAMPLE_QUERIES 10000
+
+typedef struct {
+  const char *file;
+  size_t books;
+} bench_t;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_report(const bench_t *b, const char *stage, size_t ops, double seconds) {
+  printf("{\"file\":\"%s\",\"books\":%zu,\"stage\":\"%s\",\"ops\":%zu,"
+         "\"seconds\":%.6f,\"ops_per_sec\":%.1f}\n",
+         b->file, b->books, stage, ops, seconds,
+         seconds > 0 ? ops / seconds : 0.0);
+  fflush(stdout);
+}
+
+// heap use of one stage, from the allocation counters, and peak RSS so far
+void bench_report_memory(const bench_t *b, const char *stage, uint64_t allocs, uint64_t bytes) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("{\"file\":\"%s\",\"books\":%zu,\"stage\":\"%s\",\"allocs\":%llu,"
+         "\"alloc_bytes\":%llu,\"max_rss_kb\":%ld}\n",
+         b->file, b->books, stage, (unsigned long long)allocs,
+         (unsigned long long)bytes, usage.ru_maxrss);
+  fflush(stdout);
+}
+
+int count_walk(const key_t *k, const postings_t *books, void *state) {
+  (void)k;
+  *(size_t *)state += postings_size(books);
+  return 0;
+}
+
+// counts the parsed books without keeping them
+bool parse_count(catalogue_t *c, book_t book, bool view, void *state) {
+  (void)c;
+  (void)book;
+  (void)view;
+  (*(size_t *)state)++;
+  return true;
+}
+
+// keeps an owned copy of each parsed book for the index stage
+bool parse_keep(catalogue_t *c, book_t book, bool view, void *state) {
+  (void)c;
+  (void)view;
+  book_t *bp = malloc(sizeof(book_t));
+  if (bp == NULL) die("out of memory");
+  *bp = book_copy_alloc(&book);
+  stack_push(state, bp);
+  return true;
+}
+
+// every n-th book in the list, used as search keys
+stack_t *sample_books(catalogue_t *c, size_t books, size_t samples) {
+  stack_t *s = stack_init(samples);
+  size_t step = books / samples + 1;
+  size_t i = 0;
+  for (booknode_t *bn = c->booklist.head; bn != NULL; bn = bn->next, i++)
+    if (i % step == 0) stack_push(s, bn);
+  return s;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <catalogue file>\n", argv[0]);
+    return 1;
+  }
+  bench_t b = { argv[1], 0 };
+
+  // parse only, no indexing, the way loading reads the file
+  FILE *f = fopen(argv[1], "r");
+  if (f == NULL) {
+    fprintf(stderr, "could not open %s\n", argv[1]);
+    return 1;
+  }
+  catalogue_t *c = catalogue_init();
+  uint64_t allocs = stats_counter(STAT_ALLOCS);
+  uint64_t bytes = stats_counter(STAT_ALLOC_BYTES);
+  double t = now_seconds();
+  catalogue_read_books(c, f, parse_count, &b.books);
+  double parse_seconds = now_seconds() - t;
+  bench_report(&b, "parse", b.books, parse_seconds);
+  bench_report_memory(&b, "parse_memory", stats_counter(STAT_ALLOCS) - allocs,
+                      stats_counter(STAT_ALLOC_BYTES) - bytes);
+
+  // index build from already parsed books
+  stack_t *parsed = stack_init(b.books);
+  catalogue_read_books(c, f, parse_keep, parsed);
+  fclose(f);
+  catalogue_build_indexes(c, CATALOGUE_ALL_INDEXES);
+  t = now_seconds();
+  for (size_t i = 0; i < stack_size(parsed); i++)
+    catalogue_add_book(c, *(book_t *)parsed->values[i]);
+  bench_report(&b, "index", b.books, now_seconds() - t);
+  stack_free(parsed, free);
+  catalogue_free(c);
+
+  // full load as the program does it, with every index built up front
+  c = catalogue_init();
+  catalogue_build_indexes(c, CATALOGUE_ALL_INDEXES);
+  string_t *filename = string_from_alloc(argv[1]);
+  allocs = stats_counter(STAT_ALLOCS);
+  bytes = stats_counter(STAT_ALLOC_BYTES);
+  t = now_seconds();
+  if (catalogue_read_from_file(c, filename)) return 1;
+  bench_report(&b, "load", b.books, now_seconds() - t);
+  bench_report_memory(&b, "load_memory", stats_counter(STAT_ALLOCS) - allocs,
+                      stats_counter(STAT_ALLOC_BYTES) - bytes);
+  string_free(filename);
+
+  stack_t *samples = sample_books(c, b.books, SAMPLE_QUERIES);
+  size_t found = 0;
+  t = now_seconds();
+  for (size_t i = 0; i < stack_size(samples); i++) {
+    booknode_t *bn = samples->values[i];
+    key_t key = key_from_string(bn->book.title);
+    found += avl_get(c->titles, &key) != NULL;
+  }
+  bench_report(&b, "search_exact_title", stack_size(samples), now_seconds() - t);
+
+  t = now_seconds();
+  for (size_t i = 0; i < stack_size(samples); i++) {
+    booknode_t *bn = samples->values[i];
+    stack_t *author = stack_peek(bn->book.authors);
+    if (author == NULL) continue;
+    key_t key = key_from_string(stack_peek(author));
+    found += avl_get(c->author_last_names, &key) != NULL;
+  }
+  bench_report(&b, "search_exact_author", stack_size(samples), now_seconds() - t);
+
+  size_t matches = 0;
+  t = now_seconds();
+  for (size_t i = 0; i < stack_size(samples); i++) {
+    booknode_t *bn = samples->values[i];
+    string_t *prefix = string_copy_alloc(bn->book.title);
+    while (string_length(prefix) > 4) trunc_string(prefix);
+    avl_walk_prefix(c->titles, prefix, count_walk, &matches);
+    string_free(prefix);
+  }
+  bench_report(&b, "search_prefix_title", stack_size(samples), now_seconds() - t);
+  stack_free(samples, nofree);
+  if (found == 0 && b.books > 0) fprintf(stderr, "warning: no search hits\n");
+
+  FILE *null = fopen("/dev/null", "w");
+  if (null == NULL) die("could not open /dev/null");
+  writer_t *w = writer_init(null, WRITER_DEFAULT_CAPACITY);
+  t = now_seconds();
+  booknode_print_all_books(c->booklist.head, w);
+  writer_flush(w);
+  bench_report(&b, "list_books", b.books, now_seconds() - t);
+
+  t = now_seconds();
+  catalogue_write_keys(c->titles, w);
+  catalogue_write_keys(c->subtitles, w);
+  catalogue_write_keys(c->authors, w);
+  catalogue_write_keys(c->authors_by_last_name, w);
+  catalogue_write_keys(c->author_last_names, w);
+  catalogue_write_keys(c->author_first_names, w);
+  catalogue_write_keys(c->publishers, w);
+  catalogue_write_keys(c->years, w);
+  catalogue_write_keys(c->categories, w);
+  catalogue_write_keys(c->locations, w);
+  writer_flush(w);
+  bench_report(&b, "list_indexes", b.books, now_seconds() - t);
+  writer_free(w);
+  fclose(null);
+
+  char path[] = "/tmp/library-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) die("could not create temporary file");
+  f = fdopen(fd, "w");
+  if (f == NULL) die("could not open temporary file");
+  w = writer_init(f, WRITER_DEFAULT_CAPACITY);
+  t = now_seconds();
+  booknode_write_all_to_file(c->booklist.head, w);
+  writer_flush(w);
+  bench_report(&b, "save", b.books, now_seconds() - t);
+  writer_free(w);
+  fclose(f);
+  remove(path);
+
+  t = now_seconds();
+  catalogue_free(c);
+  bench_report(&b, "free", b.books, now_seconds() - t);
+  return 0;
+}
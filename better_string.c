@@ -1,5 +1,6 @@
 #include "better_string.h"
 #include "macros.h"
+#include "stats.h"
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,12 +9,40 @@
 
 const string_t EMPTY_STRING = { .value = NULL, .len = 0, .capacity = 0 };
 
+/* A new string's buffer is allocated together with its header, directly
+   after it, so creating or freeing a string costs one heap block rather
+   than two. The buffer only moves to a separate block if the string has
+   to grow. */
+string_t *string_alloc_inline(size_t capacity) {
+  string_t *s = malloc(sizeof(string_t) + capacity * sizeof(byte_t));
+  if (s == NULL) return NULL;
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(string_t) + capacity);
+  s->value = (byte_t *)(s + 1);
+  s->len = 0;
+  s->capacity = capacity;
+  return s;
+}
+
+bool string_is_inline(const string_t *s) {
+  return s->value == (const byte_t *)(s + 1);
+}
+
+/* A view borrows len bytes, followed by a NUL, from a buffer someone
+   else owns. It has no capacity, so it is never grown or freed. */
+string_t string_view(byte_t *value, size_t len) {
+  string_t s = { .value = value, .len = len, .capacity = 0 };
+  return s;
+}
+
+bool string_is_view(const string_t *s) {
+  return s->capacity == 0 && s->value != NULL;
+}
+
 string_t *string_from_alloc_sized(const void *src, size_t len) {
   if (len == 0) return NULL;
-  string_t *s = malloc(sizeof(string_t));
+  string_t *s = string_alloc_inline(len + 1);
   if (s == NULL) return NULL;
-  s->capacity = len + 1;
-  s->value = malloc(s->capacity * sizeof(byte_t));
   memcpy(s->value, src, s->capacity);
   s->len = len;
   return s;
@@ -42,16 +71,9 @@ string_t *string_from_alloc(const void *src) {
 
 string_t *string_with_capacity(size_t capacity) {
   if (capacity == 0) return NULL;
-  string_t *s = malloc(sizeof(string_t));
+  string_t *s = string_alloc_inline(capacity);
   if (s == NULL) return NULL;
-  s->value = malloc(capacity * sizeof(byte_t));
-  if (s->value == NULL) {
-    free(s);
-    return NULL;
-  }
   s->value[0] = '\0';
-  s->len = 0;
-  s->capacity = capacity;
   return s;
 }
 
@@ -177,6 +199,21 @@ int string_comp(const string_t *s1, const string_t *s2) {
   return valuecmp((char *)s1->value, (char *)s2->value);
 }
 
+// compares only the first string_length(prefix) bytes of s, same ordering as string_comp
+int string_prefix_comp(const string_t *s, const string_t *prefix) {
+  size_t n = string_length(prefix);
+  if (n == 0) return 0;
+  if (string_length(s) == 0) return -1;
+  const char *v1 = (char *)s->value;
+  const char *v2 = (char *)prefix->value;
+  for (size_t i = 0; i < n; i++) {
+    if (v1[i] == '\0') return -1;
+    if (toupper(v1[i]) != toupper(v2[i]))
+      return (int)toupper(v1[i]) - (int)toupper(v2[i]);
+  }
+  return 0;
+}
+
 size_t string_len_utf8(const string_t *s) {
   if (s == NULL) return 0;
   size_t count = 0;
@@ -197,8 +234,18 @@ size_t string_capacity(const string_t *s) {
 
 string_result_t string_realloc(string_t *s, size_t size) {
   if (s == NULL) return STRING_NULL;
-  byte_t *tmpvalue = realloc(s->value, size * sizeof(byte_t));
+  byte_t *tmpvalue;
+  if (string_is_inline(s)) {
+    // the inline buffer cannot be resized, move to a buffer of its own
+    tmpvalue = malloc(size * sizeof(byte_t));
+    if (tmpvalue == NULL) return STRING_MEM;
+    memcpy(tmpvalue, s->value, min(size, s->capacity) * sizeof(byte_t));
+  } else {
+    tmpvalue = realloc(s->value, size * sizeof(byte_t));
+  }
   if (tmpvalue == NULL) return STRING_MEM;
+  stats_count(STAT_ALLOCS, 1);
+  if (size > s->capacity) stats_count(STAT_ALLOC_BYTES, size - s->capacity);
   s->value = tmpvalue;
   s->capacity = size;
   return STRING_OK;
@@ -207,6 +254,8 @@ string_result_t string_realloc(string_t *s, size_t size) {
 string_result_t string_realloc_with_allocator(string_t *s, size_t size, string_allocator_t allocator, string_deallocator_t deallocator, void *state) {
   if (s == NULL) return STRING_NULL;
   if (s->capacity >= size) return STRING_OK;
+  // swapping contents would leave s pointing into new_s's inline buffer
+  if (allocator == string_default_allocator) return string_realloc(s, size);
   string_t *new_s = allocator(state, size);
   if (new_s == NULL) return STRING_MEM;
   if (new_s->value == NULL) {
@@ -269,7 +318,7 @@ string_result_t string_ensure_capacity_with_allocator(string_t **s, size_t capac
 
 string_t *string_copy_with_allocator(const string_t *s, string_allocator_t allocator, void *state) {
   if (s == NULL) return NULL;
-  if (s->len >= s->capacity)
+  if (s->len >= s->capacity && !string_is_view(s))
     die("catastrophic string management failure");
   if (s->len == 0) return allocator(state, 0);
   string_t *cp = allocator(state, s->len + 1);
@@ -524,12 +573,12 @@ void string_empty(string_t *s) {
 
 void string_free_value(string_t *s) {
   if (s == NULL) return;
-  free(s->value);
+  if (!string_is_inline(s)) free(s->value);
   *s = EMPTY_STRING;
 }
 
 void string_free(void *s) {
   if (s == NULL) return;
-  free(((string_t *)s)->value);
+  if (!string_is_inline(s)) free(((string_t *)s)->value);
   free(s);
 }
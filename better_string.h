@@ -33,6 +33,14 @@ string_t *string_from_alloc(const void *src);
 
 string_t *string_with_capacity(size_t capacity);
 
+string_t *string_alloc_inline(size_t capacity);
+
+bool string_is_inline(const string_t *s);
+
+string_t string_view(byte_t *value, size_t len);
+
+bool string_is_view(const string_t *s);
+
 string_t *string_default_allocator(void *state, size_t capacity);
 
 void string_default_deallocator(void *state, string_t *string);
@@ -61,6 +69,8 @@ int utf8cmp(const byte_t *u1, const byte_t *u2);
 
 int string_comp(const string_t *s1, const string_t *s2);
 
+int string_prefix_comp(const string_t *s, const string_t *prefix);
+
 size_t string_len_utf8(const string_t *s);
 
 size_t string_length(const string_t *s);
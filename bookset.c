@@ -0,0 +1,130 @@
+#include <ctype.h>
+#include "bookset.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Hash set of the books in a catalogue, keyed by a content hash over
+   the title, subtitle, authors, publisher and year. Fields are hashed
+   upper-cased, so two books hash alike whenever the indexes would
+   compare their keys as equal. Open addressing with linear probing;
+   copies of a book get an entry each, and entries are never removed
+   (removed books are skipped on lookup). */
+
+// FNV-1a over the upper-cased string
+uint64_t hash_string(uint64_t h, const string_t *s) {
+  for (size_t i = 0; i < string_length(s); i++) {
+    h ^= (uint64_t)toupper(s->value[i]);
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+uint64_t hash_byte(uint64_t h, byte_t b) {
+  return (h ^ b) * FNV_PRIME;
+}
+
+// FNV-1a, with separator bytes so fields cannot run into each other
+uint64_t book_hash(const book_t *book) {
+  uint64_t h = FNV_OFFSET;
+  h = hash_byte(hash_string(h, book->title), 0x1f);
+  h = hash_byte(hash_string(h, book->subtitle), 0x1f);
+  for (size_t auth = 0; auth < stack_size(book->authors); auth++) {
+    const stack_t *author = book->authors->values[auth];
+    for (size_t name = 0; name < stack_size(author); name++)
+      h = hash_byte(hash_string(h, author->values[name]), ' ');
+    h = hash_byte(h, 0x1e);
+  }
+  h = hash_byte(hash_string(h, book->publisher), 0x1f);
+  for (int i = 0; i < 4; i++)
+    h = hash_byte(h, (byte_t)((unsigned)book->year >> (i * 8)));
+  return h;
+}
+
+bool book_same_content(const book_t *b1, const book_t *b2) {
+  return b1->year == b2->year
+    && string_comp(b1->title, b2->title) == 0
+    && string_comp(b1->subtitle, b2->subtitle) == 0
+    && string_comp(b1->publisher, b2->publisher) == 0
+    && authors_equal(b1->authors, b2->authors);
+}
+
+bookset_entry_t *bookset_alloc_entries(size_t capacity) {
+  bookset_entry_t *entries = calloc(capacity, sizeof(bookset_entry_t));
+  if (entries == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, capacity * sizeof(bookset_entry_t));
+  return entries;
+}
+
+bookset_t *bookset_init() {
+  bookset_t *set = malloc(sizeof(bookset_t));
+  if (set == NULL) die("out of memory");
+  set->capacity = BOOKSET_INITIAL_CAPACITY;
+  set->size = 0;
+  set->entries = bookset_alloc_entries(set->capacity);
+  return set;
+}
+
+void bookset_free(bookset_t *set) {
+  if (set == NULL) return;
+  free(set->entries);
+  free(set);
+}
+
+void bookset_insert(bookset_t *set, uint64_t hash, booknode_t *bn) {
+  size_t mask = set->capacity - 1;
+  size_t i = hash & mask;
+  while (set->entries[i].book != NULL)
+    i = (i + 1) & mask;
+  set->entries[i].hash = hash;
+  set->entries[i].book = bn;
+  set->size++;
+}
+
+void bookset_grow(bookset_t *set) {
+  bookset_entry_t *old = set->entries;
+  size_t capacity = set->capacity;
+  set->capacity *= 2;
+  set->size = 0;
+  set->entries = bookset_alloc_entries(set->capacity);
+  for (size_t i = 0; i < capacity; i++)
+    if (old[i].book != NULL) bookset_insert(set, old[i].hash, old[i].book);
+  free(old);
+}
+
+void bookset_add(bookset_t *set, booknode_t *bn) {
+  if (set == NULL) die("bookset_add(): set was null");
+  // keep the load factor below 3/4
+  if ((set->size + 1) * 4 > set->capacity * 3) bookset_grow(set);
+  bookset_insert(set, book_hash(&bn->book), bn);
+}
+
+/* Counts the books in the set with the same content as book, setting
+   first to the first of them in probe order when there are any. */
+size_t bookset_count(const bookset_t *set, const book_t *book, booknode_t **first) {
+  if (set == NULL) die("bookset_count(): set was null");
+  uint64_t hash = book_hash(book);
+  size_t mask = set->capacity - 1;
+  size_t count = 0;
+  for (size_t i = hash & mask; set->entries[i].book != NULL; i = (i + 1) & mask) {
+    const bookset_entry_t *entry = &set->entries[i];
+    if (entry->hash != hash || entry->book->book.removed) continue;
+    if (!book_same_content(&entry->book->book, book)) continue;
+    if (count == 0 && first != NULL) *first = entry->book;
+    count++;
+  }
+  return count;
+}
+
+booknode_t *bookset_find(const bookset_t *set, const book_t *book) {
+  if (set == NULL) die("bookset_find(): set was null");
+  uint64_t hash = book_hash(book);
+  size_t mask = set->capacity - 1;
+  for (size_t i = hash & mask; set->entries[i].book != NULL; i = (i + 1) & mask) {
+    const bookset_entry_t *entry = &set->entries[i];
+    if (entry->hash == hash && !entry->book->book.removed
+        && book_same_content(&entry->book->book, book))
+      return entry->book;
+  }
+  return NULL;
+}
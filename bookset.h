@@ -0,0 +1,27 @@
+#ifndef BOOKSET_H_
+#define BOOKSET_H_
+#include <stdint.h>
+#include "library.h"
+
+#define BOOKSET_INITIAL_CAPACITY 1024
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+uint64_t hash_string(uint64_t h, const string_t *s);
+
+uint64_t book_hash(const book_t *book);
+
+bool book_same_content(const book_t *b1, const book_t *b2);
+
+bookset_t *bookset_init();
+
+void bookset_free(bookset_t *set);
+
+void bookset_add(bookset_t *set, booknode_t *bn);
+
+booknode_t *bookset_find(const bookset_t *set, const book_t *book);
+
+size_t bookset_count(const bookset_t *set, const book_t *book, booknode_t **first);
+
+#endif // BOOKSET_H_
@@ -0,0 +1,134 @@
+#include "cache.h"
+#include "tree.h"
+#include "bookset.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Staff repeat the same searches over and over, so the REPL and query
+   mode remember the books the last QUERY_CACHE_CAPACITY searches found
+   and replay their ids instead of walking the index again. Keys hash
+   upper-cased, as the indexes compare them. A book filed under a key
+   drops the cached searches that key answers: the one for the key
+   itself and any prefix search it starts with. Removed books need no
+   invalidation as they are skipped when a search is replayed. */
+
+uint64_t cache_hash(const search_area_t *area, const key_t *key, bool prefix) {
+  uint64_t h = (FNV_OFFSET ^ ((uint64_t)(area - SEARCH_AREAS) * 2 + prefix)) * FNV_PRIME;
+  if (key->type == KEY_STRING) return hash_string(h, key->key);
+  return (h ^ (uint32_t)key->ikey) * FNV_PRIME;
+}
+
+query_cache_t *query_cache_init(size_t capacity) {
+  query_cache_t *cache = calloc(1, sizeof(query_cache_t));
+  if (cache == NULL) die("out of memory");
+  cache->capacity = capacity;
+  cache->buckets = calloc(2 * capacity, sizeof(cache_entry_t *));
+  if (cache->buckets == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 2);
+  stats_count(STAT_ALLOC_BYTES, sizeof(query_cache_t) + 2 * capacity * sizeof(cache_entry_t *));
+  return cache;
+}
+
+void cache_entry_free(cache_entry_t *entry) {
+  key_free(entry->key);
+  free(entry->ids);
+  free(entry);
+}
+
+void query_cache_free(query_cache_t *cache) {
+  if (cache == NULL) return;
+  cache_entry_t *entry = cache->newest;
+  while (entry != NULL) {
+    cache_entry_t *older = entry->older;
+    cache_entry_free(entry);
+    entry = older;
+  }
+  free(cache->buckets);
+  free(cache);
+}
+
+void cache_unlink(query_cache_t *cache, cache_entry_t *entry) {
+  if (entry->newer != NULL) entry->newer->older = entry->older;
+  else cache->newest = entry->older;
+  if (entry->older != NULL) entry->older->newer = entry->newer;
+  else cache->oldest = entry->newer;
+}
+
+void cache_push(query_cache_t *cache, cache_entry_t *entry) {
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest != NULL) cache->newest->newer = entry;
+  cache->newest = entry;
+  if (cache->oldest == NULL) cache->oldest = entry;
+}
+
+void cache_remove(query_cache_t *cache, cache_entry_t *entry) {
+  cache_entry_t **link = &cache->buckets[entry->hash % (2 * cache->capacity)];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  cache_unlink(cache, entry);
+  cache->size--;
+  if (entry->prefix) cache->prefixes--;
+  cache_entry_free(entry);
+}
+
+bool cache_entry_is(const cache_entry_t *entry, const search_area_t *area, const key_t *key, bool prefix) {
+  return entry->area == area && entry->prefix == prefix && key_comp(&entry->key, key) == 0;
+}
+
+// the books an earlier search found, or NULL; a hit makes it the newest entry
+const cache_entry_t *query_cache_get(query_cache_t *cache, const search_area_t *area, const key_t *key, bool prefix) {
+  uint64_t hash = cache_hash(area, key, prefix);
+  cache_entry_t *entry = cache->buckets[hash % (2 * cache->capacity)];
+  while (entry != NULL && (entry->hash != hash || !cache_entry_is(entry, area, key, prefix)))
+    entry = entry->chain;
+  if (entry == NULL) {
+    stats_count(STAT_CACHE_MISSES, 1);
+    return NULL;
+  }
+  stats_count(STAT_CACHE_HITS, 1);
+  cache_unlink(cache, entry);
+  cache_push(cache, entry);
+  return entry;
+}
+
+// takes the ids over, evicting the least recently used search if full
+void query_cache_put(query_cache_t *cache, const search_area_t *area, const key_t *key, bool prefix, uint32_t *ids, size_t size) {
+  if (cache->size == cache->capacity) cache_remove(cache, cache->oldest);
+  cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+  if (entry == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(cache_entry_t));
+  entry->area = area;
+  entry->key = key_copy(key);
+  entry->prefix = prefix;
+  entry->hash = cache_hash(area, key, prefix);
+  entry->ids = ids;
+  entry->size = size;
+  cache_entry_t **bucket = &cache->buckets[entry->hash % (2 * cache->capacity)];
+  entry->chain = *bucket;
+  *bucket = entry;
+  cache_push(cache, entry);
+  cache->size++;
+  if (prefix) cache->prefixes++;
+}
+
+// drops the searches a book newly filed under key in area would change
+void query_cache_invalidate(query_cache_t *cache, const search_area_t *area, const key_t *key) {
+  if (cache->size == 0) return;
+  uint64_t hash = cache_hash(area, key, false);
+  for (cache_entry_t *entry = cache->buckets[hash % (2 * cache->capacity)]; entry != NULL; entry = entry->chain) {
+    if (entry->hash == hash && cache_entry_is(entry, area, key, false)) {
+      cache_remove(cache, entry);
+      break;
+    }
+  }
+  if (cache->prefixes == 0 || key->type != KEY_STRING) return;
+  cache_entry_t *entry = cache->newest;
+  while (entry != NULL) {
+    cache_entry_t *older = entry->older;
+    if (entry->prefix && entry->area == area && string_prefix_comp(key->key, entry->key.key) == 0)
+      cache_remove(cache, entry);
+    entry = older;
+  }
+}
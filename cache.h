@@ -0,0 +1,44 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+#include <stdint.h>
+#include "library.h"
+
+#define QUERY_CACHE_CAPACITY 256
+
+/*! One cached search: an area, the key it looked up (a prefix when the
+  query ended in '*') and the ids of the books it found, in the order it
+  found them. */
+typedef struct CACHE_ENTRY_STRUCT {
+  struct CACHE_ENTRY_STRUCT *newer;
+  struct CACHE_ENTRY_STRUCT *older;
+  struct CACHE_ENTRY_STRUCT *chain;
+  const search_area_t *area;
+  key_t key;
+  bool prefix;
+  uint64_t hash;
+  uint32_t *ids;
+  size_t size;
+} cache_entry_t;
+
+/*! Least recently used searches, found through a chained hash table and
+  evicted from the tail of a list kept in order of use. */
+struct QUERY_CACHE_STRUCT {
+  cache_entry_t **buckets;
+  size_t capacity;
+  size_t size;
+  size_t prefixes;
+  cache_entry_t *newest;
+  cache_entry_t *oldest;
+};
+
+query_cache_t *query_cache_init(size_t capacity);
+
+void query_cache_free(query_cache_t *cache);
+
+const cache_entry_t *query_cache_get(query_cache_t *cache, const search_area_t *area, const key_t *key, bool prefix);
+
+void query_cache_put(query_cache_t *cache, const search_area_t *area, const key_t *key, bool prefix, uint32_t *ids, size_t size);
+
+void query_cache_invalidate(query_cache_t *cache, const search_area_t *area, const key_t *key);
+
+#endif // CACHE_H_
@@ -0,0 +1,209 @@
+#include <string.h>
+#include <pthread.h>
+#include "federation.h"
+#include "tree.h"
+#include "writer.h"
+#include "macros.h"
+#include "stats.h"
+#include "postings.h"
+
+/* A search across several catalogues, one per branch file, runs on a
+   thread per catalogue: each builds the index it needs and collects
+   what its catalogue finds, and the calling thread merges the lists in
+   key order once every thread is done. The catalogues are not changed
+   meanwhile, since the caller waits for the threads. */
+
+typedef struct {
+  const key_t *key;
+  const booknode_t *book;
+} fanout_match_t;
+
+typedef struct {
+  catalogue_t *catalogue;
+  const search_area_t *area;
+  const string_t *query;
+  size_t wanted;
+  bool fuzzy;
+  fanout_match_t *matches;
+  size_t size;
+  size_t allocated;
+  stack_t *keys;
+  pthread_t thread;
+} fanout_t;
+
+int fanout_walk(const key_t *k, const postings_t *books, void *state) {
+  fanout_t *f = state;
+  // the key of an exact search does not outlive catalogue_match
+  key_t *key = malloc(sizeof(key_t));
+  if (key == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(key_t));
+  *key = key_copy(k);
+  stack_push(f->keys, key);
+  postings_iter_t it;
+  postings_iter_init(&it, books);
+  for (booknode_t *bn = postings_next(&it); bn != NULL; bn = postings_next(&it)) {
+    if (bn->book.removed) continue;
+    if (f->size == f->allocated) {
+      f->allocated = max(2 * f->allocated, 16);
+      f->matches = realloc(f->matches, f->allocated * sizeof(fanout_match_t));
+      if (f->matches == NULL) die("out of memory");
+      stats_count(STAT_ALLOCS, 1);
+    }
+    f->matches[f->size++] = (fanout_match_t){ key, bn };
+  }
+  return f->size >= f->wanted;
+}
+
+// key order, and id order among the books filed under one key
+int fanout_match_comp(const void *m1, const void *m2) {
+  const fanout_match_t *a = m1, *b = m2;
+  int comp = key_comp(a->key, b->key);
+  if (comp != 0) return comp;
+  return a->book->id < b->book->id ? -1 : a->book->id > b->book->id;
+}
+
+void *fanout_run(void *arg) {
+  fanout_t *f = arg;
+  catalogue_build_indexes(f->catalogue, search_area_bit(f->area));
+  catalogue_match(f->catalogue, f->area, f->query, fanout_walk, f);
+  // a fuzzy search finds the closest entries first
+  if (f->fuzzy && f->size > 1)
+    qsort(f->matches, f->size, sizeof(fanout_match_t), fanout_match_comp);
+  return NULL;
+}
+
+/* Calls sourcefunc on the books a search finds in any of the
+   catalogues, merged in key order with ties going to the catalogue
+   listed first, or in exactly the reverse order, skipping and stopping
+   as the listing asks (NULL for every book). Fuzzy searches come out in
+   key order too, as closeness is only known within one catalogue. */
+int federation_find(catalogue_t *const *catalogues, size_t size, const search_area_t *area, const string_t *query, const listing_t *listing, sourcefunc_t sourcefunc, void *state) {
+  if (catalogues == NULL) die("federation_find(): catalogues were null");
+  size_t skip = 0, remaining = SIZE_MAX;
+  bool descending = false;
+  if (listing != NULL) {
+    skip = listing->offset;
+    if (listing->limit > 0) remaining = listing->limit;
+    descending = listing->order == LIST_DESCENDING;
+  }
+  key_t key;
+  bool prefix;
+  int distance;
+  if (!search_key(area, query, &key, &prefix, &distance)) return 0;
+  key_free(key);
+  // the first offset + limit books of each catalogue are all a merge in key order can use
+  size_t wanted = SIZE_MAX;
+  if (!descending && distance < 0 && remaining != SIZE_MAX) wanted = skip + remaining;
+
+  fanout_t *fanouts = calloc(size, sizeof(fanout_t));
+  if (fanouts == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, size * sizeof(fanout_t));
+  for (size_t i = 0; i < size; i++) {
+    fanout_t *f = &fanouts[i];
+    f->catalogue = catalogues[i];
+    f->area = area;
+    f->query = query;
+    f->wanted = wanted;
+    f->fuzzy = distance >= 0;
+    f->keys = stack_init(0);
+  }
+  // the first catalogue is searched on this thread while the others run
+  bool *started = calloc(size, sizeof(bool));
+  if (started == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, size * sizeof(bool));
+  for (size_t i = 1; i < size; i++)
+    started[i] = pthread_create(&fanouts[i].thread, NULL, fanout_run, &fanouts[i]) == 0;
+  for (size_t i = 0; i < size; i++) {
+    if (started[i]) pthread_join(fanouts[i].thread, NULL);
+    else fanout_run(&fanouts[i]);
+  }
+  free(started);
+
+  // a cursor into each list, walked from the end for descending order
+  size_t *next = calloc(size, sizeof(size_t));
+  if (next == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, size * sizeof(size_t));
+  int err = 0;
+  while (remaining > 0 && err == 0) {
+    const fanout_match_t *best = NULL;
+    size_t source = 0;
+    for (size_t i = 0; i < size; i++) {
+      if (next[i] == fanouts[i].size) continue;
+      const fanout_match_t *m = &fanouts[i].matches[descending ? fanouts[i].size - 1 - next[i] : next[i]];
+      // ties go to the catalogue listed first, or last going backwards
+      int comp = best == NULL ? -1 : key_comp(m->key, best->key);
+      if (descending ? comp >= 0 || best == NULL : comp < 0) {
+        best = m;
+        source = i;
+      }
+    }
+    if (best == NULL) break;
+    next[source]++;
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    remaining--;
+    err = sourcefunc(source, best->book, state);
+  }
+  free(next);
+
+  for (size_t i = 0; i < size; i++) {
+    for (size_t k = 0; k < stack_size(fanouts[i].keys); k++) {
+      key_t *key = fanouts[i].keys->values[k];
+      key_free(*key);
+      free(key);
+    }
+    stack_free(fanouts[i].keys, nofree);
+    free(fanouts[i].matches);
+  }
+  free(fanouts);
+  return err;
+}
+
+typedef struct {
+  const char *const *names;
+  writer_t *w;
+} federation_print_t;
+
+int federation_search_book(size_t source, const booknode_t *bn, void *state) {
+  federation_print_t *fp = state;
+  writer_append_all(fp->w, "\n   Branch: ");
+  writer_append_all(fp->w, fp->names[source]);
+  writer_append_char(fp->w, '\n');
+  print_book(&bn->book, fp->w);
+  return 0;
+}
+
+// asks for a search area and query like catalogue_search, tagging each book with its branch
+void federation_search(catalogue_t *const *catalogues, const char *const *names, size_t size, const listing_t *listing) {
+  printf("Search area: ");
+  string_t *area = file_read_line_alloc(stdin);
+  trunc_string(area);
+  if (area->len == 0) {
+    string_free(area);
+    return;
+  }
+  const char *buf = (char *)area->value;
+  const search_area_t *a = search_area_find(buf);
+  if (strcmp(buf, "h") == 0 || strcmp(buf, "help") == 0) {
+    print_search_help();
+  } else if (a == NULL) {
+    printf("\nUnknown search area\n");
+  } else {
+    printf("Search %s: ", a->description);
+    string_t *s = file_read_line_alloc(stdin);
+    trunc_string(s);
+    uint64_t start = stats_now();
+    federation_print_t fp = { names, writer_init(stdout, WRITER_DEFAULT_CAPACITY) };
+    federation_find(catalogues, size, a, s, listing, federation_search_book, &fp);
+    writer_free(fp.w);
+    stats_record_since("search lookup", start);
+    string_free(s);
+  }
+  string_free(area);
+}
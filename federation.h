@@ -0,0 +1,13 @@
+#ifndef FEDERATION_H_
+#define FEDERATION_H_
+#include "library.h"
+
+/*! Called on each book a search across several catalogues finds, with
+  the index of the catalogue it came from. */
+typedef int (*sourcefunc_t)(size_t source, const booknode_t *bn, void *state);
+
+int federation_find(catalogue_t *const *catalogues, size_t size, const search_area_t *area, const string_t *query, const listing_t *listing, sourcefunc_t sourcefunc, void *state);
+
+void federation_search(catalogue_t *const *catalogues, const char *const *names, size_t size, const listing_t *listing);
+
+#endif // FEDERATION_H_
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/* Synthetic catalogue generator for benchmarking.
+   Writes books in the catalogue file format to stdout. Authors,
+   publishers, categories and locations are drawn from Zipf
+   distributions so a few values own most of the books, like a real
+   collection. */
+
+static const char *FIRST_NAMES[] = {
+  "Johann", "Franz", "Ludwig", "Wolfgang", "Frederic", "Robert", "Clara",
+  "Sergei", "Dmitri", "Igor", "Claude", "Maurice", "Gabriel", "Edvard",
+  "Antonin", "Bela", "Stephen", "Richard", "Marie", "Ada", "Alan", "Grace",
+  "Emmy", "Leonhard", "Carl", "Henri", "David", "Donald", "Barbara", "Edsger",
+  "John", "Mary", "Jane", "Charlotte", "Emily", "George", "Virginia", "Leo",
+  "Fyodor", "Anton", "Gustave", "Honore", "Victor", "Herman", "Mark", "Ursula"
+};
+
+static const char *LAST_NAMES[] = {
+  "Bach", "Liszt", "Beethoven", "Mozart", "Chopin", "Schumann", "Rachmaninoff",
+  "Shostakovitch", "Stravinsky", "Debussy", "Ravel", "Faure", "Grieg",
+  "Dvorak", "Bartok", "Hawking", "Feynman", "Curie", "Lovelace", "Turing",
+  "Hopper", "Noether", "Euler", "Gauss", "Poincare", "Hilbert", "Knuth",
+  "Liskov", "Dijkstra", "Scriabin", "Tchaikovsky", "Austen", "Bronte",
+  "Eliot", "Woolf", "Tolstoy", "Dostoevsky", "Chekhov", "Flaubert", "Balzac",
+  "Hugo", "Melville", "Twain", "Le Guin", "Whittaker", "Watson", "Wilf"
+};
+
+static const char *WORDS[] = {
+  "Preludes", "Sonatas", "Etudes", "Nocturnes", "Variations", "Concerto",
+  "Symphony", "Introduction", "Principles", "Theory", "History", "Analysis",
+  "Elements", "Handbook", "Guide", "Art", "Science", "Music", "Piano", "Organ",
+  "Mathematics", "Algebra", "Geometry", "Number", "Time", "Space", "Light",
+  "Chess", "Games", "Stories", "Tales", "Letters", "Journeys", "Voices",
+  "Modern", "Classical", "Complete", "Selected", "Collected", "Brief",
+  "Western", "Eastern", "Northern", "Southern", "Silent", "Hidden", "Lost",
+  "Golden", "Little", "Great", "First", "Last", "Second", "New", "Old"
+};
+
+static const char *CATEGORIES[] = {
+  "Music", "Mathematics", "Fiction", "PopSci", "Kids", "Games", "History",
+  "Physics", "Computing", "Poetry", "Biography", "Reference", "Art", "Travel",
+  "Philosophy", "Languages", "Cooking", "Religion", "Drama", "Weather"
+};
+
+static const char *LOCATIONS[] = {
+  "Pender", "Annex", "Basement", "Office", "Loft", "Study", "Garage", "Attic"
+};
+
+static const char *PUBLISHERS[] = {
+  "Dover", "Penguin", "Cambridge University Press", "Oxford University Press",
+  "Springer", "Henle", "Peters", "Schirmer", "Bantam Books", "Norton",
+  "Annick Press", "New In Chess", "A K Peters", "Vintage", "Faber", "Kalmus"
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng_next() {
+  uint64_t x = rng_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng_state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double rng_unit() {
+  return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+typedef struct {
+  double *cdf;
+  size_t n;
+} zipf_t;
+
+static zipf_t zipf_init(size_t n, double s) {
+  zipf_t z = { malloc(n * sizeof(double)), n };
+  if (z.cdf == NULL) {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(1);
+  }
+  double total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += 1.0 / pow(i + 1, s);
+    z.cdf[i] = total;
+  }
+  for (size_t i = 0; i < n; i++) z.cdf[i] /= total;
+  return z;
+}
+
+static size_t zipf_sample(const zipf_t *z) {
+  double u = rng_unit();
+  size_t lo = 0, hi = z->n - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (z->cdf[mid] < u) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static void print_author(size_t id) {
+  size_t first = id % COUNT(FIRST_NAMES);
+  size_t last = (id / COUNT(FIRST_NAMES)) % COUNT(LAST_NAMES);
+  size_t generation = id / (COUNT(FIRST_NAMES) * COUNT(LAST_NAMES));
+  printf("%s ", FIRST_NAMES[first]);
+  // a middle initial keeps large author pools distinct
+  if (generation > 0) printf("%c. ", 'A' + (int)(generation % 26));
+  if (generation > 26) printf("%c. ", 'A' + (int)(generation / 26 % 26));
+  printf("%s", LAST_NAMES[last]);
+}
+
+static void print_words(size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0) printf(" ");
+    printf("%s", WORDS[rng_next() % COUNT(WORDS)]);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <books> [seed] > catalogue.txt\n", argv[0]);
+    return 1;
+  }
+  size_t books = strtoull(argv[1], NULL, 10);
+  if (argc == 3) rng_state ^= strtoull(argv[2], NULL, 10) * 0xBF58476D1CE4E5B9ull;
+  if (rng_state == 0) rng_state = 1;
+
+  size_t authors = books / 4 + 1;
+  zipf_t author_dist = zipf_init(authors, 1.1);
+  zipf_t category_dist = zipf_init(COUNT(CATEGORIES), 1.2);
+  zipf_t location_dist = zipf_init(COUNT(LOCATIONS), 1.5);
+  zipf_t publisher_dist = zipf_init(COUNT(PUBLISHERS), 1.0);
+
+  for (size_t b = 0; b < books; b++) {
+    // title: a few words plus the book number so most titles are unique,
+    // with a small share of repeated titles (new editions, translations)
+    print_words(1 + rng_next() % 4);
+    if (rng_next() % 10 != 0) printf(" %zu", b);
+    printf(";");
+    if (rng_next() % 3 == 0) print_words(2 + rng_next() % 5);
+    printf(";");
+    size_t nauthors = 1 + (rng_next() % 8 == 0) + (rng_next() % 32 == 0);
+    for (size_t a = 0; a < nauthors; a++) {
+      if (a > 0) printf(",");
+      print_author(zipf_sample(&author_dist));
+    }
+    printf(";%s", PUBLISHERS[zipf_sample(&publisher_dist)]);
+    printf(";%s", LOCATIONS[zipf_sample(&location_dist)]);
+    printf(";%d;", 1800 + (int)(rng_next() % 226));
+    size_t ncategories = 1 + (rng_next() % 5 == 0);
+    for (size_t c = 0; c < ncategories; c++) {
+      if (c > 0) printf(",");
+      printf("%s", CATEGORIES[zipf_sample(&category_dist)]);
+    }
+    printf("\n");
+  }
+
+  free(author_dist.cdf);
+  free(category_dist.cdf);
+  free(location_dist.cdf);
+  free(publisher_dist.cdf);
+  return 0;
+}
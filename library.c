@@ -1,7 +1,21 @@
 #include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "library.h"
 #include "tree.h"
+#include "writer.h"
 #include "macros.h"
+#include "stats.h"
+#include "bookset.h"
+#include "postings.h"
+#include "pool.h"
+#include "cache.h"
+#include "phonetic.h"
+#include "reader.h"
 
 const book_t DEFAULT_BOOK = {
   .title = NULL,
@@ -18,6 +32,8 @@ void stack_realloc(stack_t *s, size_t capacity) {
   if(s->capacity >= capacity) return;
   void **values = realloc(s->values, capacity * sizeof(void *));
   if (values == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, (capacity - s->capacity) * sizeof(void *));
   s->capacity = capacity;
   s->values = values;
 }
@@ -26,9 +42,12 @@ stack_t *stack_init(size_t capacity) {
   stack_t *s = malloc(sizeof(stack_t));
   if (s == NULL) die("out of memory");
   s->values = NULL;
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(stack_t) + capacity * sizeof(void *));
   if (capacity != 0) {
     s->values = malloc(capacity * sizeof(void *));
     if (s->values == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
   }
   s->size = 0;
   s->capacity = capacity;
@@ -153,46 +172,46 @@ void book_free(book_t b) {
   string_stack_free(b.categories);
 }
 
-void print_authors(stack_t *s) {
+void write_authors(stack_t *s, writer_t *w, const char *sep) {
   for (size_t auth = 0; auth < stack_size(s); auth++) {
     stack_t *authstack = s->values[auth];
     if (stack_size(authstack) == 0) continue;
     for (size_t name = 0; name < authstack->size - 1; name++) {
-      print(authstack->values[name]);
-      printf(" ");
+      writer_append_string(w, authstack->values[name]);
+      writer_append_char(w, ' ');
     }
-    print(authstack->values[authstack->size - 1]);
-    if (auth != stack_size(s) - 1) printf(", ");
+    writer_append_string(w, authstack->values[authstack->size - 1]);
+    if (auth != stack_size(s) - 1) writer_append_all(w, sep);
   }
 }
 
-void print_categories(stack_t *cat) {
-  if (stack_size(cat) > 0) {
-    printf("\nCategories: ");
-    for (size_t i = 0; i < cat->size - 1; i++) {
-      print(cat->values[i]);
-      printf(", ");
-    }
-    print(cat->values[cat->size - 1]);
+void write_categories(stack_t *cat, writer_t *w, const char *sep) {
+  for (size_t i = 0; i < stack_size(cat); i++) {
+    writer_append_string(w, cat->values[i]);
+    if (i != stack_size(cat) - 1) writer_append_all(w, sep);
   }
 }
 
-void print_book(const book_t *book) {
+void print_book(const book_t *book, writer_t *w) {
   if (book == NULL) die("print_book(): book was null");
   if (book->removed) return;
-  printf("    Title: ");
-  print(book->title);
-  printf("\n Subtitle: ");
-  print(book->subtitle);
-  printf("\nAuthor(s): ");
-  print_authors(book->authors);
-  printf("\nPublisher: ");
-  print(book->publisher);
-  printf("\n     Year: %d", book->year);
-  printf("\n Location: ");
-  print(book->location);
-  print_categories(book->categories);
-  printf("\n");
+  writer_append_all(w, "    Title: ");
+  writer_append_string(w, book->title);
+  writer_append_all(w, "\n Subtitle: ");
+  writer_append_string(w, book->subtitle);
+  writer_append_all(w, "\nAuthor(s): ");
+  write_authors(book->authors, w, ", ");
+  writer_append_all(w, "\nPublisher: ");
+  writer_append_string(w, book->publisher);
+  writer_append_all(w, "\n     Year: ");
+  writer_append_int(w, book->year);
+  writer_append_all(w, "\n Location: ");
+  writer_append_string(w, book->location);
+  if (stack_size(book->categories) > 0) {
+    writer_append_all(w, "\nCategories: ");
+    write_categories(book->categories, w, ", ");
+  }
+  writer_append_char(w, '\n');
 }
 
 void trunc_string(string_t *s) {
@@ -299,149 +318,141 @@ bool read_book(book_t *bookptr) {
   return true;
 }
 
-bool read_next_section(const byte_t **b, string_t **s) {
-  *s = string_with_capacity(DEFAULT_STRING_LENGTH);
-  while (**b != ';') {
-    if (**b == '\n' || **b == '\0') {
-      printf("Warning: read invalid book\n");
-      return true;
-    }
-    string_append_alloc(*s, *b);
-    inc_utf8(b);
-  }
-  inc_utf8(b);
-  return false;
+// copies the bytes from start up to end into a string of exactly that size
+string_t *section_alloc(const byte_t *start, const byte_t *end) {
+  size_t len = end - start;
+  string_t *s = string_with_capacity(len + 1);
+  if (s == NULL) die("out of memory");
+  memcpy(s->value, start, len * sizeof(byte_t));
+  s->value[len] = '\0';
+  s->len = len;
+  return s;
 }
 
-bool read_authors(const byte_t **b, stack_t *authors) {
-  stack_t *author = stack_init(3);
-  string_t *name = string_with_capacity(DEFAULT_STRING_LENGTH);
-  while (**b == ' ' || **b == ',') (*b)++;
-  while (**b != ';') {
-    if (**b == '\n' || **b == '\0') {
-      printf("Warning: read invalid book\n");
-      return true;
-    }
-    string_append_alloc(name, *b);
-    inc_utf8(b);
-    if (**b == ' ' || **b == ',') {
-      stack_push(author, name);
-      while (**b == ' ') (*b)++;
-      name = string_with_capacity(DEFAULT_STRING_LENGTH);
-    }
-    if (**b == ',') {
-      stack_push(authors, author);
-      while (**b == ' ' || **b == ',') (*b)++;
-      author = stack_init(3);
-    }
-  }
-  inc_utf8(b);
-  if (string_length(name) > 0)
-    stack_push(author, name);
-  else
-    string_free(name);
-  if (stack_size(author) > 0)
-    stack_push(authors, author);
-  else
-    string_stack_free(author);
-  return false;
+/* Books in the catalogue are packed: the node, the string and stack
+   headers of every field and all their bytes share one allocation, laid
+   out in field order, so reading a book touches one block instead of a
+   dozen scattered ones. Packed books are read-only; their strings and
+   stacks must not be grown or freed on their own. */
+
+typedef struct {
+  byte_t *base;
+  size_t used;
+} packer_t;
+
+// reserves size bytes of the block, or only counts them when base is NULL
+void *pack_take(packer_t *p, size_t size, size_t align) {
+  p->used = (p->used + align - 1) / align * align;
+  void *taken = p->base == NULL ? NULL : p->base + p->used;
+  p->used += size;
+  return taken;
 }
 
-#define RETURN_FALSE(result)                                      \
-  if (result) { book_free(book); string_free(s); return false; }
-
-bool book_read_from_file(FILE *f, book_t *bookptr) {
-  string_t *s = file_read_line_alloc(f);
-  if (s == NULL) die("book_read_from_file(): out of memory");
-  if (s->value[0] == '\0' || s->value[0] == '\n') {
-    string_free(s);
-    return false;
+// views keep pointing at the buffer they borrow from
+string_t *pack_string(packer_t *p, const string_t *s) {
+  if (s == NULL) return NULL;
+  string_t *packed = pack_take(p, sizeof(string_t), _Alignof(string_t));
+  if (string_is_view(s)) {
+    if (packed != NULL) *packed = *s;
+    return packed;
   }
-  book_t book = default_book();
-  const byte_t *b = s->value;
-  RETURN_FALSE(read_next_section(&b, &book.title));
-  RETURN_FALSE(read_next_section(&b, &book.subtitle));
-  RETURN_FALSE(read_authors(&b, book.authors));
-  RETURN_FALSE(read_next_section(&b, &book.publisher));
-  RETURN_FALSE(read_next_section(&b, &book.location));
-  string_t *year;
-  RETURN_FALSE(read_next_section(&b, &year));
-  if (sscanf((char *)year->value, "%d\n", &book.year) != 1) {
-    string_free(year);
-    RETURN_FALSE(true);
+  byte_t *value = pack_take(p, s->len + 1, 1);
+  if (p->base == NULL) return NULL;
+  memcpy(value, s->value, s->len + 1);
+  packed->value = value;
+  packed->len = s->len;
+  packed->capacity = s->len + 1;
+  return packed;
+}
+
+stack_t *pack_stack(packer_t *p, const stack_t *s, void *(*pack_value)(packer_t *, const void *)) {
+  if (s == NULL) return NULL;
+  stack_t *packed = pack_take(p, sizeof(stack_t), _Alignof(stack_t));
+  void **values = pack_take(p, s->size * sizeof(void *), _Alignof(void *));
+  if (packed != NULL) {
+    packed->values = values;
+    packed->size = s->size;
+    packed->capacity = s->size;
   }
-  string_free(year);
-  while (*b != '\n' && *b != '\0') {
-    if (*b == ',') { inc_utf8(&b); continue; }
-    string_t *newstr = string_with_capacity(DEFAULT_STRING_LENGTH);
-    while (*b != ',' && *b != '\n' && *b != '\0') {
-      string_append_alloc(newstr, b);
-      inc_utf8(&b);
-    }
-    stack_push(book.categories, newstr);
+  for (size_t i = 0; i < s->size; i++) {
+    void *value = pack_value(p, s->values[i]);
+    if (values != NULL) values[i] = value;
   }
-  string_free(s);
-  *bookptr = book;
-  return true;
+  return packed;
 }
 
-booknode_t *booknode_init() {
-  booknode_t *node = malloc(sizeof(booknode_t));
-  if (node == NULL) die("out of memory");
-  return node;
+void *pack_string_value(packer_t *p, const void *s) {
+  return pack_string(p, s);
 }
 
-void booknode_free(booknode_t *bn) {
-  if (bn == NULL) return;
-  book_free(bn->book);
-  booknode_free(bn->next);
-  free(bn);
+void *pack_author(packer_t *p, const void *author) {
+  return pack_stack(p, author, pack_string_value);
 }
 
-void booknode_print_all_books(booknode_t *bn) {
-  if (bn == NULL) return;
-  if (bn->book.removed == false) {
-    print_book(&bn->book);
-    printf("\n");
-  }
-  booknode_print_all_books(bn->next);
+void pack_book(packer_t *p, const book_t *src, book_t *dst) {
+  dst->title = pack_string(p, src->title);
+  dst->subtitle = pack_string(p, src->subtitle);
+  dst->authors = pack_stack(p, src->authors, pack_author);
+  dst->publisher = pack_string(p, src->publisher);
+  dst->location = pack_string(p, src->location);
+  dst->year = src->year;
+  dst->categories = pack_stack(p, src->categories, pack_string_value);
+  dst->removed = src->removed;
 }
 
-void write_book_to_file(const book_t *book, FILE *f) {
-  if (!book->removed) {
-    fprint(f, book->title);
-    fprintf(f, ";");
-    fprint(f, book->subtitle);
-    fprintf(f, ";");
-    for (int auth = 0; auth < stack_size(book->authors); auth++) {
-      stack_t *author = book->authors->values[auth];
-      for (int name = 0; name < stack_size(author); name++) {
-        fprint(f, author->values[name]);
-        if (name != stack_size(author) - 1)
-          fprintf(f, " ");
-      }
-      if (auth != stack_size(book->authors) - 1)
-        fprintf(f, ",");
-    }
-    fprintf(f, ";");
-    fprint(f, book->publisher);
-    fprintf(f, ";");
-    fprint(f, book->location);
-    fprintf(f, ";");
-    fprintf(f, "%d;", book->year);
-    for (int cat = 0; cat < stack_size(book->categories); cat++) {
-      fprint(f, book->categories->values[cat]);
-      if (cat != stack_size(book->categories) - 1)
-        fprintf(f, ",");
-    }
-    fprintf(f, "\n");
+// copies book into a single new block: measured once, then filled in
+booknode_t *booknode_pack(const book_t *book, arena_t *arena) {
+  book_t ignored;
+  packer_t p = { NULL, sizeof(booknode_t) };
+  pack_book(&p, book, &ignored);
+  booknode_t *node = arena_alloc(arena, p.used);
+  p = (packer_t){ (byte_t *)node, sizeof(booknode_t) };
+  pack_book(&p, book, &node->book);
+  node->next = NULL;
+  return node;
+}
+
+void booknode_print_all_books(booknode_t *bn, writer_t *w) {
+  for (; bn != NULL; bn = bn->next) {
+    if (bn->book.removed) continue;
+    print_book(&bn->book, w);
+    writer_append_char(w, '\n');
   }
 }
 
-void booknode_write_all_to_file(booknode_t *bn, FILE *f) {
-  if (bn == NULL) return;
-  write_book_to_file(&bn->book, f);
-  booknode_write_all_to_file(bn->next, f);
+void write_book_to_file(const book_t *book, writer_t *w) {
+  if (book->removed) return;
+  writer_append_string(w, book->title);
+  writer_append_char(w, ';');
+  writer_append_string(w, book->subtitle);
+  writer_append_char(w, ';');
+  write_authors(book->authors, w, ",");
+  writer_append_char(w, ';');
+  writer_append_string(w, book->publisher);
+  writer_append_char(w, ';');
+  writer_append_string(w, book->location);
+  writer_append_char(w, ';');
+  writer_append_int(w, book->year);
+  writer_append_char(w, ';');
+  write_categories(book->categories, w, ",");
+  writer_append_char(w, '\n');
+}
+
+void booknode_write_all_to_file(booknode_t *bn, writer_t *w) {
+  for (; bn != NULL; bn = bn->next)
+    write_book_to_file(&bn->book, w);
+}
+
+bool authors_equal(const stack_t *a1, const stack_t *a2) {
+  if (stack_size(a1) != stack_size(a2)) return false;
+  for (size_t auth = 0; auth < stack_size(a1); auth++) {
+    const stack_t *n1 = a1->values[auth];
+    const stack_t *n2 = a2->values[auth];
+    if (stack_size(n1) != stack_size(n2)) return false;
+    for (size_t name = 0; name < stack_size(n1); name++)
+      if (string_comp(n1->values[name], n2->values[name]) != 0) return false;
+  }
+  return true;
 }
 
 bool booknode_isbook(void *bn, void *) {
@@ -449,17 +460,22 @@ bool booknode_isbook(void *bn, void *) {
   return ((booknode_t *)bn)->book.removed == false;
 }
 
-bool book_exists(stack_t *s) {
-  return stack_exists(s, NULL, booknode_isbook);
+bool book_exists(const postings_t *books) {
+  postings_iter_t it;
+  postings_iter_init(&it, books);
+  for (booknode_t *bn = postings_next(&it); bn != NULL; bn = postings_next(&it))
+    if (!bn->book.removed) return true;
+  return false;
 }
 
-booknode_t *booksll_add_book(booksll_t *booksll, book_t book) {
+// takes the book over: it is packed into the new node and the original freed
+booknode_t *booksll_add_book(booksll_t *booksll, book_t book, arena_t *arena) {
   if (booksll == NULL) die("booksll was null");
-  booknode_t *tmphead = booksll->head;
-  booksll->head = booknode_init();
-  booksll->head->book = book;
-  booksll->head->next = tmphead;
-  return booksll->head;
+  booknode_t *node = booknode_pack(&book, arena);
+  book_free(book);
+  node->next = booksll->head;
+  booksll->head = node;
+  return node;
 }
 
 void remove_book(booknode_t *bn) {
@@ -470,33 +486,154 @@ void remove_book(booknode_t *bn) {
 catalogue_t *catalogue_init() {
   catalogue_t *c = calloc(1, sizeof(catalogue_t));
   if (c == NULL) die("out of memory");
+  c->books = bookset_init();
+  c->ids = booktable_init();
+  c->nodes = pool_init(max(sizeof(avl_t), sizeof(avl_entry_t)));
+  c->arena = arena_init();
+  c->buffers = stack_init(1);
   return c;
 }
 
-void catalogue_add_authors(catalogue_t *c, stack_t *authors, booknode_t *link) {
+void title_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  keyfunc(key_borrow_string(link->book.title), link, state);
+}
+
+void subtitle_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  keyfunc(key_borrow_string(link->book.subtitle), link, state);
+}
+
+// "First Middle Last"
+string_t *author_full_name(const stack_t *author) {
+  string_t *fullname = string_with_capacity(DEFAULT_STRING_LENGTH);
+  for (int i = 0; i < stack_size(author); i++) {
+    string_concat_alloc(fullname, author->values[i]);
+    string_append_alloc(fullname, (const byte_t *)" ");
+  }
+  trunc_string(fullname);
+  return fullname;
+}
+
+// "Last, First Middle"
+string_t *author_by_last_name(const stack_t *author) {
+  string_t *by_last_name = string_with_capacity(DEFAULT_STRING_LENGTH);
+  string_concat_alloc(by_last_name, stack_peek(author));
+  string_append_all_alloc(by_last_name, (const byte_t *)", ");
+  for (int i = 0; i < stack_size(author) - 1; i++) {
+    string_concat_alloc(by_last_name, author->values[i]);
+    string_append_alloc(by_last_name, (const byte_t *)" ");
+  }
+  trunc_string(by_last_name);
+  return by_last_name;
+}
+
+void author_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *authors = link->book.authors;
   for (int auth = 0; auth < stack_size(authors); auth++) {
     stack_t *author = authors->values[auth];
-    if (stack_size(author) > 0) {
-      key_t firstname = key_from_string(string_copy_alloc(author->values[0]));
-      key_t lastname = key_from_string(string_copy_alloc(stack_peek(author)));
-      avl_add(&c->author_first_names, firstname, link, nofree);
-      avl_add(&c->author_last_names, lastname, link, nofree);
-      string_t *fullname = string_with_capacity(DEFAULT_STRING_LENGTH);
-      for (int i = 0; i < stack_size(author); i++) {
-        string_concat_alloc(fullname, author->values[i]);
-        string_append_alloc(fullname, (const byte_t *)" ");
-      }
-      trunc_string(fullname);
-      avl_add(&c->authors, key_from_string(fullname), link, nofree);
-      string_t *by_last_name = string_with_capacity(DEFAULT_STRING_LENGTH);
-      string_concat_alloc(by_last_name, stack_peek(author));
-      string_append_all_alloc(by_last_name, (const byte_t *)", ");
-      for (int i = 0; i < stack_size(author) - 1; i++) {
-        string_concat_alloc(by_last_name, author->values[i]);
-        string_append_alloc(by_last_name, (const byte_t *)" ");
-      }
-      trunc_string(by_last_name);
-      avl_add(&c->authors_by_last_name, key_from_string(by_last_name), link, nofree);
+    if (stack_size(author) > 0)
+      keyfunc(key_from_string(author_full_name(author)), link, state);
+  }
+}
+
+void author_by_last_name_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *authors = link->book.authors;
+  for (int auth = 0; auth < stack_size(authors); auth++) {
+    stack_t *author = authors->values[auth];
+    if (stack_size(author) > 0)
+      keyfunc(key_from_string(author_by_last_name(author)), link, state);
+  }
+}
+
+void author_last_name_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *authors = link->book.authors;
+  for (int auth = 0; auth < stack_size(authors); auth++) {
+    stack_t *author = authors->values[auth];
+    if (stack_size(author) > 0)
+      keyfunc(key_borrow_string(stack_peek(author)), link, state);
+  }
+}
+
+void author_first_name_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *authors = link->book.authors;
+  for (int auth = 0; auth < stack_size(authors); auth++) {
+    stack_t *author = authors->values[auth];
+    if (stack_size(author) > 0)
+      keyfunc(key_borrow_string(author->values[0]), link, state);
+  }
+}
+
+void author_sound_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *authors = link->book.authors;
+  for (int auth = 0; auth < stack_size(authors); auth++) {
+    stack_t *author = authors->values[auth];
+    if (stack_size(author) > 0)
+      keyfunc(key_from_string(phonetic_author_key(author)), link, state);
+  }
+}
+
+void publisher_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  keyfunc(key_borrow_string(link->book.publisher), link, state);
+}
+
+void year_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  keyfunc(key_from_int(link->book.year), link, state);
+}
+
+void category_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  stack_t *categories = link->book.categories;
+  for (int cat = 0; cat < stack_size(categories); cat++)
+    keyfunc(key_borrow_string(categories->values[cat]), link, state);
+}
+
+void location_keys(booknode_t *link, keyfunc_t keyfunc, void *state) {
+  keyfunc(key_borrow_string(link->book.location), link, state);
+}
+
+typedef struct {
+  avl_t **root;
+  pool_t *pool;
+  const booktable_t *ids;
+} index_state_t;
+
+void index_key(key_t key, booknode_t *link, void *state) {
+  index_state_t *is = state;
+  avl_add(is->root, key, link, is->pool, is->ids);
+}
+
+// files a book under its keys in the area's index
+void area_index_book(const search_area_t *area, avl_t **root, booknode_t *link, pool_t *pool, const booktable_t *ids) {
+  index_state_t is = { root, pool, ids };
+  area->keys(link, index_key, &is);
+}
+
+avl_t **catalogue_area_root(catalogue_t *c, const search_area_t *area) {
+  return (avl_t **)((char *)c + area->index);
+}
+
+typedef struct {
+  query_cache_t *cache;
+  const search_area_t *area;
+} invalidate_state_t;
+
+void invalidate_key(key_t key, booknode_t *link, void *state) {
+  (void)link;
+  invalidate_state_t *is = state;
+  query_cache_invalidate(is->cache, is->area, &key);
+  key_free(key);
+}
+
+/* Files a packed book in every index built so far. Its strings outlive
+   the indexes, so keys borrow them rather than copying. */
+void catalogue_index_book(catalogue_t *c, booknode_t *link) {
+  bookset_add(c->books, link);
+  booktable_add(c->ids, link);
+  c->size = link->id + 1;
+  for (const search_area_t *a = SEARCH_AREAS; a->shortname != NULL; a++) {
+    if (c->indexes & search_area_bit(a))
+      area_index_book(a, catalogue_area_root(c, a), link, c->nodes, c->ids);
+    if (c->cache != NULL && c->cache->size > 0) {
+      invalidate_state_t is = { c->cache, a };
+      a->keys(link, invalidate_key, &is);
     }
   }
 }
@@ -504,122 +641,524 @@ void catalogue_add_authors(catalogue_t *c, stack_t *authors, booknode_t *link) {
 void catalogue_add_book(catalogue_t *c, book_t book) {
   if (c == NULL) die("catalogue_add_book(): catalogue was null");
   if (book.removed) return;
-  booknode_t *link = booksll_add_book(&c->booklist, book);
-  key_t title = key_from_string(string_copy_alloc(book.title));
-  avl_add(&c->titles, title, link, nofree);
-  key_t subtitle = key_from_string(string_copy_alloc(book.subtitle));
-  avl_add(&c->subtitles, subtitle, link, nofree);
-  catalogue_add_authors(c, book.authors, link);
-  key_t publisher = key_from_string(string_copy_alloc(book.publisher));
-  avl_add(&c->publishers, publisher, link, nofree);
-  key_t location = key_from_string(string_copy_alloc(book.location));
-  avl_add(&c->locations, location, link, nofree);
-  key_t year = key_from_int(book.year);
-  avl_add(&c->years, year, link, nofree);
-  for (int cat = 0; cat < stack_size(book.categories); cat++) {
-    string_t *catstring = book.categories->values[cat];
-    key_t category = key_from_string(string_copy_alloc(catstring));
-    avl_add(&c->categories, category, link, nofree);
+  catalogue_index_book(c, booksll_add_book(&c->booklist, book, c->arena));
+}
+
+// same title, subtitle, authors, publisher and year
+bool catalogue_contains_book(const catalogue_t *c, const book_t *book) {
+  if (c == NULL) die("catalogue_contains_book(): catalogue was null");
+  const booknode_t *bn = bookset_find(c->books, book);
+  return bn != NULL && bn->id < c->size;
+}
+
+// the book with this id, which must belong to this version of the catalogue
+booknode_t *catalogue_book(const catalogue_t *c, uint32_t id) {
+  if (id >= c->size) die("catalogue_book(): invalid book id");
+  return booktable_get(c->ids, id);
+}
+
+// lists every book held more than once, each with its number of copies
+void catalogue_print_dupes(const catalogue_t *c) {
+  if (c == NULL) die("catalogue_print_dupes(): catalogue was null");
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  size_t groups = 0, copies = 0;
+  for (booknode_t *bn = c->booklist.head; bn != NULL; bn = bn->next) {
+    if (bn->book.removed) continue;
+    booknode_t *first = NULL;
+    size_t count = bookset_count(c->books, &bn->book, &first);
+    // report each group once, at the copy the set finds first
+    if (count < 2 || first != bn) continue;
+    groups++;
+    copies += count - 1;
+    writer_append_int(w, count);
+    writer_append_all(w, " copies of\n");
+    print_book(&bn->book, w);
+    writer_append_char(w, '\n');
   }
+  writer_free(w);
+  printf("%zu books with duplicates, %zu extra copies\n", groups, copies);
 }
 
 void catalogue_free(catalogue_t *c) {
   if (c == NULL) return;
-  booknode_free(c->booklist.head);
-  avl_free(c->titles);
-  avl_free(c->subtitles);
-  avl_free(c->authors);
-  avl_free(c->authors_by_last_name);
-  avl_free(c->author_last_names);
-  avl_free(c->author_first_names);
-  avl_free(c->publishers);
-  avl_free(c->categories);
-  avl_free(c->years);
-  avl_free(c->locations);
+  catalogue_finish_indexes(c, CATALOGUE_ALL_INDEXES, true);
+  query_cache_free(c->cache);
+  bookset_free(c->books);
+  booktable_free(c->ids);
+  stack_free(c->buffers, free);
+  pool_t *nodes = c->nodes;
+  arena_t *arena = c->arena;
+  catalogue_snapshot_free(c);
+  pool_free(nodes);
+  arena_free(arena);
+}
+
+/* A point-in-time view of the catalogue that later additions do not
+   change: the indexes are shared and copied node by node as the
+   catalogue is modified. It shares the books, the id table, the node
+   pool, the loaded files and the duplicate set, which keep following
+   the catalogue, and must be freed before the catalogue it was taken
+   from. The snapshot keeps the size of the id table it was taken at and
+   looks books up only below it (catalogue_book), and a book found in
+   the duplicate set counts only if its id is below it too. */
+catalogue_t *catalogue_snapshot(const catalogue_t *c) {
+  if (c == NULL) die("catalogue_snapshot(): catalogue was null");
+  catalogue_t *snapshot = malloc(sizeof(catalogue_t));
+  if (snapshot == NULL) die("out of memory");
+  *snapshot = *c;
+  // background builds and cached searches are the catalogue's own
+  snapshot->jobs = NULL;
+  snapshot->cache = NULL;
+  avl_retain(snapshot->titles);
+  avl_retain(snapshot->subtitles);
+  avl_retain(snapshot->authors);
+  avl_retain(snapshot->authors_by_last_name);
+  avl_retain(snapshot->author_last_names);
+  avl_retain(snapshot->author_first_names);
+  avl_retain(snapshot->author_sounds);
+  avl_retain(snapshot->publishers);
+  avl_retain(snapshot->categories);
+  avl_retain(snapshot->years);
+  avl_retain(snapshot->locations);
+  return snapshot;
+}
+
+// frees the indexes but not the books
+void catalogue_snapshot_free(catalogue_t *c) {
+  if (c == NULL) return;
+  avl_free(c->titles, c->nodes);
+  avl_free(c->subtitles, c->nodes);
+  avl_free(c->authors, c->nodes);
+  avl_free(c->authors_by_last_name, c->nodes);
+  avl_free(c->author_last_names, c->nodes);
+  avl_free(c->author_first_names, c->nodes);
+  avl_free(c->author_sounds, c->nodes);
+  avl_free(c->publishers, c->nodes);
+  avl_free(c->categories, c->nodes);
+  avl_free(c->years, c->nodes);
+  avl_free(c->locations, c->nodes);
   free(c);
 }
 
-void catalogue_print_all_books(catalogue_t *c) {
+// "limit N", "offset M", "asc" and "desc", in any order
+bool listing_parse(const char *args, listing_t *listing) {
+  *listing = (listing_t){ 0, 0, LIST_DEFAULT };
+  while (true) {
+    while (*args == ' ') args++;
+    if (*args == '\0') return true;
+    int len = 0;
+    unsigned long n;
+    if (sscanf(args, "limit %lu%n", &n, &len) == 1 && len > 0) listing->limit = n;
+    else if (sscanf(args, "offset %lu%n", &n, &len) == 1 && len > 0) listing->offset = n;
+    else if (strncmp(args, "asc", 3) == 0) listing->order = LIST_ASCENDING, len = 3;
+    else if (strncmp(args, "desc", 4) == 0) listing->order = LIST_DESCENDING, len = 4;
+    else return false;
+    args += len;
+    if (*args != ' ' && *args != '\0') return false;
+  }
+}
+
+/* Books are listed newest first unless the listing asks for ascending
+   order. A part of the list is read from the book table in id order;
+   removed books stay in the table flagged, so they are passed over
+   without counting toward the offset or the limit. */
+void catalogue_print_all_books(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_books(): catalogue was null");
-  booknode_print_all_books(c->booklist.head);
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  if (listing == NULL || (listing->offset == 0 && listing->limit == 0 && listing->order != LIST_ASCENDING)) {
+    booknode_print_all_books(c->booklist.head, w);
+    writer_free(w);
+    return;
+  }
+  uint32_t size = c->size;
+  size_t skip = listing->offset;
+  size_t limit = listing->limit == 0 ? SIZE_MAX : listing->limit;
+  for (uint32_t i = 0; i < size && limit > 0; i++) {
+    uint32_t id = listing->order == LIST_ASCENDING ? i : size - 1 - i;
+    booknode_t *bn = catalogue_book(c, id);
+    if (bn->book.removed) continue;
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    print_book(&bn->book, w);
+    writer_append_char(w, '\n');
+    limit--;
+  }
+  writer_free(w);
 }
 
-int catalogue_print_walk(const key_t *k, stack_t *d, void *state) {
+int catalogue_print_walk(const key_t *k, const postings_t *books, void *state) {
   if (k == NULL) die("avl walk key was null");
-  if (book_exists(d)) {
-    key_print(k);
-    printf("\n");
+  if (book_exists(books)) {
+    key_write(k, state);
+    writer_append_char(state, '\n');
   }
   return 0;
 }
 
-void catalogue_print_all_titles(catalogue_t *c) {
+void catalogue_write_keys(const avl_t *avl, writer_t *w) {
+  avl_walk((avl_t *)avl, catalogue_print_walk, w);
+}
+
+void catalogue_print_keys(const avl_t *avl) {
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  catalogue_write_keys(avl, w);
+  writer_free(w);
+}
+
+// builds the area's index if need be; keys are listed in ascending order by default
+void catalogue_print_area(catalogue_t *c, const char *name, const listing_t *listing) {
+  const search_area_t *area = search_area_find(name);
+  catalogue_build_indexes(c, search_area_bit(area));
+  avl_t *avl = catalogue_area_index(c, area);
+  if (listing == NULL) {
+    catalogue_print_keys(avl);
+    return;
+  }
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  avl_walk_range(avl, listing->offset, listing->limit, listing->order == LIST_DESCENDING, catalogue_print_walk, w);
+  writer_free(w);
+}
+
+void catalogue_print_all_titles(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_titles(): catalogue was null");
-  avl_walk(c->titles, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "title", listing);
 }
 
-void catalogue_print_all_subtitles(catalogue_t *c) {
+void catalogue_print_all_subtitles(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_subtitles(): catalogue was null");
-  avl_walk(c->subtitles, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "subtitle", listing);
 }
 
-void catalogue_print_all_authors(catalogue_t *c) {
+void catalogue_print_all_authors(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_authors(): catalogue was null");
-  avl_walk(c->authors, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "author", listing);
 }
 
-void catalogue_print_all_authors_by_last_name(catalogue_t *c) {
+void catalogue_print_all_authors_by_last_name(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_authors_by_last_name(): catalogue was null");
-  avl_walk(c->authors_by_last_name, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "lastname", listing);
 }
 
-void catalogue_print_all_author_last_names(catalogue_t *c) {
+void catalogue_print_all_author_last_names(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_author_last_names(): catalogue was null");
-  avl_walk(c->author_last_names, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "authorlast", listing);
 }
 
-void catalogue_print_all_author_first_names(catalogue_t *c) {
+void catalogue_print_all_author_first_names(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_author_first_names(): catalogue was null");
-  avl_walk(c->author_first_names, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "authorfirst", listing);
 }
 
-void catalogue_print_all_publishers(catalogue_t *c) {
+void catalogue_print_all_publishers(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_publishers(): catalogue was null");
-  avl_walk(c->publishers, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "pub", listing);
 }
 
-void catalogue_print_all_years(catalogue_t *c) {
+void catalogue_print_all_years(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_years(): catalogue was null");
-  avl_walk(c->years, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "year", listing);
 }
 
-void catalogue_print_all_categories(catalogue_t *c) {
+void catalogue_print_all_categories(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_categories(): catalogue was null");
-  avl_walk(c->categories, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "cat", listing);
 }
 
-void catalogue_print_all_locations(catalogue_t *c) {
+void catalogue_print_all_locations(catalogue_t *c, const listing_t *listing) {
   if (c == NULL) die("catalogue_print_all_locations(): catalogue was null");
-  avl_walk(c->locations, catalogue_print_walk, NULL);
+  catalogue_print_area(c, "location", listing);
 }
 
-void catalogue_write_to_file(catalogue_t *c, string_t *filename) {
-  if (c == NULL) die("catalogue_write_to_file(): catalogue was null");
-  if (filename == NULL) {
-    printf("Invalid filename, try again\n");
-    return;
+/* Writes the whole catalogue to <path>.tmp and renames it over path, so
+   the file is replaced in one step or not at all. The save is split for
+   a forked child of a process whose other threads may hold the locks of
+   malloc or stdio: catalogue_save_open opens the file and allocates the
+   buffer before the fork, catalogue_save_write only formats books into
+   that buffer and calls write, close, rename and unlink, and
+   catalogue_save_close releases the parent's copies. */
+bool catalogue_save_open(catalogue_save_t *save, const catalogue_t *c, const char *path) {
+  if (c == NULL) die("catalogue_save_open(): catalogue was null");
+  save->catalogue = c;
+  save->path = path;
+  save->tmp = string_from_alloc(path);
+  string_append_all_alloc(save->tmp, (const byte_t *)".tmp");
+  int fd = open((char *)save->tmp->value, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    string_free(save->tmp);
+    return false;
   }
-  if (filename->value == NULL) {
-    printf("Invalid filename, try again\n");
+  save->w = writer_init_fd(fd, WRITER_DEFAULT_CAPACITY);
+  return true;
+}
+
+int catalogue_save_write(catalogue_save_t *save) {
+  writer_t *w = save->w;
+  booknode_write_all_to_file(save->catalogue->booklist.head, w);
+  int err = writer_flush(w);
+  if (close(w->fd) != 0) err = 1;
+  const char *tmp = (char *)save->tmp->value;
+  if (!err && rename(tmp, save->path) != 0) err = 1;
+  if (err) unlink(tmp);
+  return err;
+}
+
+// removes the temporary file too if the save was never written
+void catalogue_save_close(catalogue_save_t *save, bool discard) {
+  close(save->w->fd);
+  if (discard) unlink((char *)save->tmp->value);
+  // nothing was appended on this side of the fork, so nothing is flushed
+  writer_free(save->w);
+  string_free(save->tmp);
+}
+
+// writes the books added after since, oldest first, as add_book did
+void catalogue_write_books_since(const catalogue_t *c, const booknode_t *since, writer_t *w) {
+  stack_t *added = stack_init(0);
+  for (booknode_t *bn = c->booklist.head; bn != NULL && bn != since; bn = bn->next)
+    stack_push(added, bn);
+  while (stack_size(added) > 0)
+    write_book_to_file(&((booknode_t *)stack_pop(added))->book, w);
+  stack_free(added, nofree);
+}
+
+/* Loaded catalogue files are parsed in place. The whole file is read
+   into one buffer that the catalogue keeps, each field's delimiter is
+   overwritten with a NUL, and the book's strings become views of the
+   buffer. A parser reuses its string headers and stacks from book to
+   book, so packing the book into the catalogue is the only allocation.
+   Streams that cannot be read whole are parsed the same way inside a
+   block buffer that is reused for the next lines; their strings are
+   marked as owned so packing copies them out of the block. */
+
+struct VIEW_PARSER_STRUCT {
+  book_t book;
+  stack_t *strings;
+  stack_t *authors;
+  size_t used_strings;
+  size_t used_authors;
+  // the buffer is reused, so strings must be copied when packed
+  bool transient;
+};
+
+view_parser_t *view_parser_init() {
+  view_parser_t *vp = calloc(1, sizeof(view_parser_t));
+  if (vp == NULL) die("out of memory");
+  vp->strings = stack_init(16);
+  vp->authors = stack_init(4);
+  vp->book.authors = stack_init(4);
+  vp->book.categories = stack_init(4);
+  return vp;
+}
+
+void view_parser_free(view_parser_t *vp) {
+  stack_free(vp->strings, free);
+  for (size_t i = 0; i < stack_size(vp->authors); i++)
+    stack_free(vp->authors->values[i], nofree);
+  stack_free(vp->authors, nofree);
+  stack_free(vp->book.authors, nofree);
+  stack_free(vp->book.categories, nofree);
+  free(vp);
+}
+
+// the view of start up to end, where the NUL is written
+string_t *view_parser_string(view_parser_t *vp, byte_t *start, byte_t *end) {
+  if (vp->used_strings == stack_size(vp->strings)) {
+    string_t *s = malloc(sizeof(string_t));
+    if (s == NULL) die("out of memory");
+    stack_push(vp->strings, s);
+  }
+  string_t *s = vp->strings->values[vp->used_strings++];
+  *end = '\0';
+  *s = string_view(start, end - start);
+  if (vp->transient) s->capacity = s->len + 1;
+  return s;
+}
+
+stack_t *view_parser_author(view_parser_t *vp) {
+  if (vp->used_authors == stack_size(vp->authors))
+    stack_push(vp->authors, stack_init(3));
+  stack_t *author = vp->authors->values[vp->used_authors++];
+  author->size = 0;
+  return author;
+}
+
+bool view_next_section(byte_t **b, view_parser_t *vp, string_t **s) {
+  byte_t *start = *b;
+  while (**b != ';') {
+    if (**b == '\0') return false;
+    (*b)++;
+  }
+  *s = view_parser_string(vp, start, *b);
+  (*b)++;
+  return true;
+}
+
+bool view_authors(byte_t **b, view_parser_t *vp) {
+  stack_t *author = view_parser_author(vp);
+  while (**b == ' ' || **b == ',') (*b)++;
+  byte_t *start = *b;
+  while (**b != ';') {
+    if (**b == '\0') return false;
+    (*b)++;
+    if (**b == ' ' || **b == ',') {
+      bool comma = **b == ',';
+      stack_push(author, view_parser_string(vp, start, *b));
+      (*b)++;
+      while (**b == ' ') (*b)++;
+      if (comma || **b == ',') {
+        stack_push(vp->book.authors, author);
+        while (**b == ' ' || **b == ',') (*b)++;
+        author = view_parser_author(vp);
+      }
+      start = *b;
+    }
+  }
+  if (*b > start)
+    stack_push(author, view_parser_string(vp, start, *b));
+  (*b)++;
+  if (stack_size(author) > 0)
+    stack_push(vp->book.authors, author);
+  return true;
+}
+
+/* Parses one NUL-terminated line in the catalogue file format in place:
+   the returned book's strings are views of line, valid until vp parses
+   the next one. */
+const book_t *book_parse_view(view_parser_t *vp, byte_t *line, size_t len) {
+  if (len == 0) return NULL;
+  stats_count(STAT_BYTES_PARSED, len + 1);
+  stats_count(STAT_BOOKS_PARSED, 1);
+  book_t *book = &vp->book;
+  vp->used_strings = vp->used_authors = 0;
+  book->authors->size = book->categories->size = 0;
+  book->removed = false;
+  byte_t *b = line;
+  string_t *year;
+  if (!view_next_section(&b, vp, &book->title)
+      || !view_next_section(&b, vp, &book->subtitle)
+      || !view_authors(&b, vp)
+      || !view_next_section(&b, vp, &book->publisher)
+      || !view_next_section(&b, vp, &book->location)
+      || !view_next_section(&b, vp, &year)) {
+    fprintf(stderr, "Warning: read invalid book\n");
+    return NULL;
+  }
+  if (sscanf((char *)year->value, "%d", &book->year) != 1) return NULL;
+  while (*b != '\0') {
+    if (*b == ',') { b++; continue; }
+    byte_t *start = b;
+    while (*b != ',' && *b != '\0') b++;
+    bool last = *b == '\0';
+    stack_push(book->categories, view_parser_string(vp, start, b));
+    if (!last) b++;
+  }
+  return book;
+}
+
+// an owned copy of a parsed book, whose strings are views of its line
+book_t book_copy_alloc(const book_t *view) {
+  book_t book = default_book();
+  book.title = section_alloc(view->title->value, view->title->value + view->title->len);
+  book.subtitle = section_alloc(view->subtitle->value, view->subtitle->value + view->subtitle->len);
+  for (size_t i = 0; i < stack_size(view->authors); i++) {
+    const stack_t *names = view->authors->values[i];
+    stack_t *author = stack_init(stack_size(names));
+    for (size_t n = 0; n < stack_size(names); n++) {
+      const string_t *name = names->values[n];
+      stack_push(author, section_alloc(name->value, name->value + name->len));
+    }
+    stack_push(book.authors, author);
+  }
+  book.publisher = section_alloc(view->publisher->value, view->publisher->value + view->publisher->len);
+  book.location = section_alloc(view->location->value, view->location->value + view->location->len);
+  book.year = view->year;
+  for (size_t i = 0; i < stack_size(view->categories); i++) {
+    const string_t *category = view->categories->values[i];
+    stack_push(book.categories, section_alloc(category->value, category->value + category->len));
+  }
+  return book;
+}
+
+// reads all of f into a NUL-terminated buffer, or returns NULL if it cannot be sized
+byte_t *file_read_all(FILE *f, size_t *len) {
+  if (fseek(f, 0, SEEK_END) != 0) return NULL;
+  long size = ftell(f);
+  if (size < 0 || fseek(f, 0, SEEK_SET) != 0) return NULL;
+  byte_t *buffer = malloc(size + 1);
+  if (buffer == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, size + 1);
+  *len = fread(buffer, 1, size, f);
+  buffer[*len] = '\0';
+  return buffer;
+}
+
+/* Calls func on each book of f until the first line that is not one, or
+   until func returns false; blank lines are skipped. A file is read
+   whole and parsed in place, its buffer kept only while a loaded book
+   borrows from it; a pipe or other stream that cannot be sized is read
+   in blocks. */
+void catalogue_read_books(catalogue_t *c, FILE *f, bool (*func)(catalogue_t *, book_t, bool, void *), void *state) {
+  size_t len;
+  byte_t *buffer = file_read_all(f, &len);
+  view_parser_t *vp = view_parser_init();
+  if (buffer == NULL) {
+    vp->transient = true;
+    reader_t *r = reader_init(f, READER_DEFAULT_CAPACITY);
+    for (byte_t *line = reader_next_line(r, &len); line != NULL; line = reader_next_line(r, &len)) {
+      if (len == 0) continue;
+      const book_t *book = book_parse_view(vp, line, len);
+      if (book == NULL || !func(c, *book, true, state)) break;
+    }
+    if (reader_free(r)) fprintf(stderr, "Warning: error reading catalogue\n");
+    view_parser_free(vp);
     return;
   }
-  FILE *f = fopen((char *)filename->value, "w");
-  if (f == NULL) {
-    printf("Invalid filename, try again\n");
+  uint32_t books = c->size;
+  for (byte_t *line = buffer; line < buffer + len; ) {
+    byte_t *end = memchr(line, '\n', buffer + len - line);
+    if (end == NULL) end = buffer + len;
+    *end = '\0';
+    if (end > line) {
+      const book_t *book = book_parse_view(vp, line, end - line);
+      if (book == NULL || !func(c, *book, true, state)) break;
+    }
+    line = end + 1;
+  }
+  view_parser_free(vp);
+  // an import of nothing but duplicates leaves no book borrowing from it
+  if (c->size > books) stack_push(c->buffers, buffer);
+  else free(buffer);
+}
+
+// "-" reads the catalogue from stdin
+FILE *catalogue_open(const string_t *filename) {
+  if (strcmp((char *)filename->value, "-") == 0) return stdin;
+  return fopen((char *)filename->value, "r");
+}
+
+void catalogue_close(FILE *f) {
+  if (f != stdin) fclose(f);
+}
+
+// packs a parsed book into the catalogue; views are only borrowed, not freed
+void catalogue_add_parsed(catalogue_t *c, book_t book, bool view) {
+  if (!view) {
+    catalogue_add_book(c, book);
     return;
   }
-  booknode_write_all_to_file(c->booklist.head, f);
-  fclose(f);
+  booknode_t *node = booknode_pack(&book, c->arena);
+  node->next = c->booklist.head;
+  c->booklist.head = node;
+  catalogue_index_book(c, node);
+}
+
+bool catalogue_load_book(catalogue_t *c, book_t book, bool view, void *state) {
+  (void)state;
+  catalogue_add_parsed(c, book, view);
+  return true;
 }
 
 int catalogue_read_from_file(catalogue_t *c, string_t *filename) {
@@ -632,83 +1171,478 @@ int catalogue_read_from_file(catalogue_t *c, string_t *filename) {
     printf("Invalid filename, try again\n");
     return 1;
   }
-  FILE *f = fopen((char *)filename->value, "r");
+  FILE *f = catalogue_open(filename);
   if (f == NULL) {
     printf("Invalid filename, try again\n");
     return 1;
   }
-  book_t book;
-  while (book_read_from_file(f, &book)) {
+  uint64_t start = stats_now();
+  catalogue_read_books(c, f, catalogue_load_book, NULL);
+  catalogue_close(f);
+  stats_record_since("load", start);
+  return 0;
+}
 
-    catalogue_add_book(c, book);
+typedef struct {
+  writer_t *w;
+  size_t imported;
+  size_t duplicates;
+} import_state_t;
+
+bool catalogue_import_book(catalogue_t *c, book_t book, bool view, void *state) {
+  import_state_t *is = state;
+  if (catalogue_contains_book(c, &book)) {
+    if (!view) book_free(book);
+    is->duplicates++;
+    return true;
+  }
+  write_book_to_file(&book, is->w);
+  catalogue_add_parsed(c, book, view);
+  is->imported++;
+  return true;
+}
+
+/* Reads every book in filename into the catalogue, skipping books already
+   present (same title, subtitle, authors, publisher and year, ignoring
+   case, as found through the book set's content hash), and appends the
+   new ones to w with a single flush at the end. */
+int catalogue_import(catalogue_t *c, string_t *filename, writer_t *w) {
+  if (c == NULL) die("catalogue_import(): catalogue was null");
+  if (string_length(filename) == 0) {
+    printf("Invalid filename, try again\n");
+    return 1;
+  }
+  FILE *f = catalogue_open(filename);
+  if (f == NULL) {
+    printf("Invalid filename, try again\n");
+    return 1;
   }
-  fclose(f);
+  uint64_t start = stats_now();
+  import_state_t is = { w, 0, 0 };
+  catalogue_read_books(c, f, catalogue_import_book, &is);
+  catalogue_close(f);
+  int err = writer_flush(w);
+  stats_record_since("import", start);
+  if (err) {
+    printf("Error writing imported books to the catalogue file\n");
+    return 1;
+  }
+  double seconds = (stats_now() - start) / 1e9;
+  printf("Imported %zu books (%zu duplicates skipped) in %.3f s (%.1f books/s)\n",
+         is.imported, is.duplicates, seconds, seconds > 0 ? is.imported / seconds : 0.0);
   return 0;
 }
 
-// implement searching by year
-void catalogue_search(catalogue_t *c) {
+const search_area_t SEARCH_AREAS[] = {
+  { .shortname = "t",  .name = "title",       .description = "titles",
+    .index = offsetof(catalogue_t, titles), .keys = title_keys },
+  { .shortname = "st", .name = "subtitle",    .description = "subtitles",
+    .index = offsetof(catalogue_t, subtitles), .keys = subtitle_keys },
+  { .shortname = "a",  .name = "author",      .description = "authors",
+    .index = offsetof(catalogue_t, authors), .keys = author_keys },
+  { .shortname = "l",  .name = "lastname",    .description = "authors",
+    .index = offsetof(catalogue_t, authors_by_last_name), .keys = author_by_last_name_keys },
+  { .shortname = "al", .name = "authorlast",  .description = "author last names",
+    .index = offsetof(catalogue_t, author_last_names), .keys = author_last_name_keys },
+  { .shortname = "af", .name = "authorfirst", .description = "author first names",
+    .index = offsetof(catalogue_t, author_first_names), .keys = author_first_name_keys },
+  { .shortname = "as", .name = "authorsound", .description = "authors by sound",
+    .index = offsetof(catalogue_t, author_sounds), .keys = author_sound_keys, .phonetic = true },
+  { .shortname = "p",  .name = "pub",         .description = "publishers",
+    .index = offsetof(catalogue_t, publishers), .keys = publisher_keys },
+  { .shortname = "y",  .name = "year",        .description = "years",
+    .index = offsetof(catalogue_t, years), .keys = year_keys, .numeric = true },
+  { .shortname = "c",  .name = "cat",         .description = "categories",
+    .index = offsetof(catalogue_t, categories), .keys = category_keys },
+  { .shortname = "lc", .name = "location",    .description = "locations",
+    .index = offsetof(catalogue_t, locations), .keys = location_keys },
+  { .shortname = NULL }
+};
+
+const search_area_t *search_area_find(const char *name) {
+  for (const search_area_t *a = SEARCH_AREAS; a->shortname != NULL; a++)
+    if (strcmp(name, a->shortname) == 0 || strcmp(name, a->name) == 0) return a;
+  return NULL;
+}
+
+// the bit standing for area's index in catalogue_t.indexes
+uint32_t search_area_bit(const search_area_t *area) {
+  return 1u << (area - SEARCH_AREAS);
+}
+
+// "all", "none" or a comma separated list of search areas
+bool catalogue_parse_indexes(const char *list, uint32_t *indexes) {
+  if (strcmp(list, "all") == 0) {
+    *indexes = CATALOGUE_ALL_INDEXES;
+    return true;
+  }
+  *indexes = 0;
+  if (strcmp(list, "none") == 0) return true;
+  while (true) {
+    const char *end = strchr(list, ',');
+    size_t len = end == NULL ? strlen(list) : (size_t)(end - list);
+    char name[16];
+    if (len >= sizeof(name)) return false;
+    memcpy(name, list, len);
+    name[len] = '\0';
+    const search_area_t *area = search_area_find(name);
+    if (area == NULL) return false;
+    *indexes |= search_area_bit(area);
+    if (end == NULL) return true;
+    list = end + 1;
+  }
+}
+
+/* Indexes are only built once something searches or lists them, apart
+   from those asked for before the catalogue is loaded. A late index is
+   filled from the book table oldest book first, so its posting lists
+   come out in the same id order as if it had been there all along. */
+void catalogue_build_indexes(catalogue_t *c, uint32_t indexes) {
+  if (c == NULL) die("catalogue_build_indexes(): catalogue was null");
+  catalogue_finish_indexes(c, indexes, true);
+  for (const search_area_t *a = SEARCH_AREAS; a->shortname != NULL; a++) {
+    uint32_t bit = search_area_bit(a);
+    if ((indexes & bit) == 0 || (c->indexes & bit) != 0) continue;
+    uint64_t start = stats_now();
+    avl_t **root = catalogue_area_root(c, a);
+    for (uint32_t id = 0; id < c->size; id++)
+      area_index_book(a, root, catalogue_book(c, id), c->nodes, c->ids);
+    c->indexes |= bit;
+    if (c->size > 0) stats_record_since("index build", start);
+  }
+}
+
+/* An index built on a thread of its own. The thread files the books
+   there were when it started in a tree and node pool of its own while
+   the catalogue goes on being used and added to; books added meanwhile
+   are filed once the catalogue takes the tree over. */
+struct INDEX_JOB_STRUCT {
+  struct INDEX_JOB_STRUCT *next;
+  const search_area_t *area;
+  const booktable_t *ids;
+  uint32_t end;
+  avl_t *root;
+  pool_t *nodes;
+  uint64_t nanoseconds;
+  atomic_bool done;
+  pthread_t thread;
+};
+
+void *index_job_run(void *arg) {
+  index_job_t *job = arg;
+  uint64_t start = stats_now();
+  for (uint32_t id = 0; id < job->end; id++)
+    area_index_book(job->area, &job->root, booktable_get(job->ids, id), job->nodes, job->ids);
+  job->nanoseconds = stats_now() - start;
+  atomic_store(&job->done, true);
+  return NULL;
+}
+
+bool catalogue_index_building(const catalogue_t *c, const search_area_t *area) {
+  for (index_job_t *job = c->jobs; job != NULL; job = job->next)
+    if (job->area == area) return true;
+  return false;
+}
+
+// starts a thread for each of these indexes that is not built or being built
+void catalogue_build_indexes_background(catalogue_t *c, uint32_t indexes) {
+  if (c == NULL) die("catalogue_build_indexes_background(): catalogue was null");
+  for (const search_area_t *a = SEARCH_AREAS; a->shortname != NULL; a++) {
+    uint32_t bit = search_area_bit(a);
+    if ((indexes & bit) == 0 || (c->indexes & bit) != 0 || catalogue_index_building(c, a)) continue;
+    if (c->size == 0) {
+      c->indexes |= bit;
+      continue;
+    }
+    index_job_t *job = calloc(1, sizeof(index_job_t));
+    if (job == NULL) die("out of memory");
+    job->area = a;
+    job->ids = c->ids;
+    job->end = c->size;
+    job->nodes = pool_init(c->nodes->size);
+    atomic_init(&job->done, false);
+    if (pthread_create(&job->thread, NULL, index_job_run, job) != 0) {
+      pool_free(job->nodes);
+      free(job);
+      catalogue_build_indexes(c, bit);
+      continue;
+    }
+    job->next = c->jobs;
+    c->jobs = job;
+  }
+}
+
+void index_job_finish(catalogue_t *c, index_job_t *job) {
+  pthread_join(job->thread, NULL);
+  pool_merge(c->nodes, job->nodes);
+  avl_t **root = catalogue_area_root(c, job->area);
+  *root = job->root;
+  for (uint32_t id = job->end; id < c->size; id++)
+    area_index_book(job->area, root, catalogue_book(c, id), c->nodes, c->ids);
+  c->indexes |= search_area_bit(job->area);
+  stats_record("index build", job->nanoseconds);
+  free(job);
+}
+
+// takes over the background builds of these indexes that are done, or waits for them
+void catalogue_finish_indexes(catalogue_t *c, uint32_t indexes, bool block) {
+  if (c == NULL) die("catalogue_finish_indexes(): catalogue was null");
+  index_job_t **link = &c->jobs;
+  while (*link != NULL) {
+    index_job_t *job = *link;
+    bool wanted = (indexes & search_area_bit(job->area)) != 0;
+    if (wanted && (block || atomic_load(&job->done))) {
+      *link = job->next;
+      index_job_finish(c, job);
+    } else {
+      link = &job->next;
+    }
+  }
+}
+
+int catalogue_count_walk(const key_t *k, const postings_t *books, void *state) {
+  (void)k;
+  (void)books;
+  (*(size_t *)state)++;
+  return 0;
+}
+
+// which indexes are built, their sizes and the memory their nodes take
+void catalogue_print_indexes(const catalogue_t *c) {
+  if (c == NULL) die("catalogue_print_indexes(): catalogue was null");
+  printf("%sIndexes:%s\n", BWHT, CRESET);
+  size_t built = 0, total = 0;
+  for (const search_area_t *a = SEARCH_AREAS; a->shortname != NULL; a++) {
+    total++;
+    printf(" %-3s %-12s ", a->shortname, a->name);
+    if ((c->indexes & search_area_bit(a)) == 0) {
+      printf(catalogue_index_building(c, a) ? "building\n" : "not built\n");
+      continue;
+    }
+    size_t keys = 0;
+    avl_walk(catalogue_area_index(c, a), catalogue_count_walk, &keys);
+    printf("built, %zu keys\n", keys);
+    built++;
+  }
+  size_t bytes = c->nodes->used * c->nodes->size;
+  printf("%zu of %zu indexes built, %zu index nodes (%.1f MiB)\n",
+         built, total, c->nodes->used, bytes / (1024.0 * 1024.0));
+}
+
+avl_t *catalogue_area_index(const catalogue_t *c, const search_area_t *area) {
+  if ((c->indexes & search_area_bit(area)) == 0) die("catalogue_area_index(): index was not built");
+  return *(avl_t **)((char *)c + area->index);
+}
+
+// the edits a fuzzy search allows by default, more for longer queries
+size_t fuzzy_distance(size_t len) {
+  if (len < 3) return 0;
+  if (len < 6) return 1;
+  return 2;
+}
+
+/* The key a search looks up, a copy of the query without its trailing
+   '*' for a prefix search or '~' (optionally followed by the number of
+   edits allowed) for a fuzzy one, or the phonetic code of the author
+   name it holds in a phonetic area. A backslash before the '*' or '~'
+   makes it part of an exact search instead (Why\* finds "Why*").
+   distance is set to -1 unless the search is fuzzy. False if the query
+   cannot match anything. */
+bool search_key(const search_area_t *area, const string_t *query, key_t *key, bool *prefix, int *distance) {
+  size_t len = string_length(query);
+  *prefix = false;
+  *distance = -1;
+  if (area->numeric) {
+    int year;
+    if (len == 0 || sscanf((char *)query->value, "%d", &year) != 1) return false;
+    *key = key_from_int(year);
+    return true;
+  }
+  if (area->phonetic) {
+    string_t *code = phonetic_query_key(query, prefix);
+    if (code == NULL) return false;
+    *key = key_from_string(code);
+    return true;
+  }
+  *key = key_from_string(string_copy_alloc(query));
+  string_t *k = key->key;
+  // where the trailing operator starts, if there is one
+  size_t op = len;
+  if (len > 0 && (query->value[len - 1] == '*' || query->value[len - 1] == '~')) op = len - 1;
+  else if (len > 1 && query->value[len - 2] == '~' && isdigit(query->value[len - 1])) op = len - 2;
+  if (op < len && op > 0 && query->value[op - 1] == '\\') {
+    memmove(k->value + op - 1, k->value + op, len - op + 1);
+    k->len--;
+  } else if (len > 0 && query->value[len - 1] == '*') {
+    trunc_string(k);
+    *prefix = true;
+  } else if (len > 1 && query->value[len - 2] == '~' && isdigit(query->value[len - 1])) {
+    *distance = min(query->value[len - 1] - '0', FUZZY_MAX_DISTANCE);
+    k->value[k->len -= 2] = '\0';
+  } else if (len > 0 && query->value[len - 1] == '~') {
+    trunc_string(k);
+    *distance = fuzzy_distance(k->len);
+  }
+  return true;
+}
+
+/* Calls walkfunc on the entry matching query exactly, on every entry
+   starting with it when the query ends in '*', or on every entry within
+   a few edits of it, closest first, when it ends in '~'. */
+int catalogue_match(const catalogue_t *c, const search_area_t *area, const string_t *query, avl_walkfunc_t walkfunc, void *state) {
+  if (c == NULL) die("catalogue_match(): catalogue was null");
+  avl_t *avl = catalogue_area_index(c, area);
+  key_t key;
+  bool prefix;
+  int distance;
+  if (!search_key(area, query, &key, &prefix, &distance)) return 0;
+  int err = 0;
+  if (prefix) {
+    err = avl_walk_prefix(avl, key.key, walkfunc, state);
+  } else if (distance >= 0) {
+    err = avl_walk_fuzzy(avl, key.key, distance, walkfunc, state);
+  } else {
+    const postings_t *books = avl_get(avl, &key);
+    if (books != NULL) err = walkfunc(&key, books, state);
+  }
+  key_free(key);
+  return err;
+}
+
+typedef struct {
+  bookfunc_t bookfunc;
+  void *state;
+  size_t skip;
+  size_t remaining;
+  stack_t *found;
+} find_state_t;
+
+// returns non-zero once no more books are wanted
+int find_book(find_state_t *fs, const booknode_t *bn) {
+  if (bn->book.removed) return 0;
+  if (fs->skip > 0) {
+    fs->skip--;
+    return 0;
+  }
+  fs->remaining--;
+  RET_IF(fs->bookfunc(bn, fs->state));
+  return fs->remaining == 0;
+}
+
+int find_walk(const key_t *k, const postings_t *books, void *state) {
+  (void)k;
+  find_state_t *fs = state;
+  postings_iter_t it;
+  postings_iter_init(&it, books);
+  for (booknode_t *bn = postings_next(&it); bn != NULL; bn = postings_next(&it)) {
+    if (fs->found != NULL) stack_push(fs->found, bn);
+    else RET_IF(find_book(fs, bn));
+  }
+  return 0;
+}
+
+// the ids of every book the search finds, removed ones included
+uint32_t *find_all(const catalogue_t *c, const search_area_t *area, const string_t *query, size_t *size) {
+  find_state_t fs = { NULL, NULL, 0, 0, stack_init(0) };
+  catalogue_match(c, area, query, find_walk, &fs);
+  *size = stack_size(fs.found);
+  uint32_t *ids = malloc(max(*size, 1) * sizeof(uint32_t));
+  if (ids == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, max(*size, 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < *size; i++)
+    ids[i] = ((booknode_t *)fs.found->values[i])->id;
+  stack_free(fs.found, nofree);
+  return ids;
+}
+
+/* Calls bookfunc on the books a search finds, in the order
+   catalogue_match finds them or the reverse, skipping and stopping as
+   the listing asks (NULL for every book). With a query cache the ids of
+   the books are kept, removed ones included, and a repeated search
+   replays them instead of walking the index; fuzzy searches are never
+   kept. Otherwise a search in the usual order streams and stops as
+   soon as the limit is reached. */
+int catalogue_find(const catalogue_t *c, const search_area_t *area, const string_t *query, const listing_t *listing, bookfunc_t bookfunc, void *state) {
+  if (c == NULL) die("catalogue_find(): catalogue was null");
+  find_state_t fs = { bookfunc, state, 0, SIZE_MAX, NULL };
+  bool descending = false;
+  if (listing != NULL) {
+    fs.skip = listing->offset;
+    if (listing->limit > 0) fs.remaining = listing->limit;
+    descending = listing->order == LIST_DESCENDING;
+  }
+  const cache_entry_t *entry = NULL;
+  uint32_t *ids;
+  size_t size;
+  if (c->cache != NULL) {
+    key_t key;
+    bool prefix;
+    int distance;
+    if (!search_key(area, query, &key, &prefix, &distance)) return 0;
+    // any key added near a fuzzy search could change it, so it is not kept
+    if (distance < 0) {
+      entry = query_cache_get(c->cache, area, &key, prefix);
+      if (entry == NULL) {
+        ids = find_all(c, area, query, &size);
+        query_cache_put(c->cache, area, &key, prefix, ids, size);
+        entry = c->cache->newest;
+      }
+    }
+    key_free(key);
+  }
+  if (entry == NULL && !descending) return catalogue_match(c, area, query, find_walk, &fs);
+  if (entry != NULL) {
+    ids = entry->ids;
+    size = entry->size;
+  } else {
+    ids = find_all(c, area, query, &size);
+  }
+  for (size_t i = 0; i < size; i++) {
+    booknode_t *bn = catalogue_book(c, ids[descending ? size - 1 - i : i]);
+    if (find_book(&fs, bn)) break;
+  }
+  if (entry == NULL) free(ids);
+  return 0;
+}
+
+void catalogue_search(catalogue_t *c, const listing_t *listing) {
   printf("Search area: ");
   string_t *area = file_read_line_alloc(stdin);
   trunc_string(area);
-  if (area->len == 0) return;
+  if (area->len == 0) {
+    string_free(area);
+    return;
+  }
   const char *buf = (char *)area->value;
+  const search_area_t *a = search_area_find(buf);
   if (strcmp(buf, "h") == 0 || strcmp(buf, "help") == 0) {
     print_search_help();
-  } else if (strcmp(buf, "t") == 0 || strcmp(buf, "title") == 0) {
-    string_free(area);
-    printf("Search titles: ");
-    catalogue_search_avl(c->titles);
-  } else if (strcmp(buf, "st") == 0 || strcmp(buf, "subtitle") == 0) {
-    string_free(area);
-    printf("Search subtitles: ");
-    catalogue_search_avl(c->subtitles);
-  } else if (strcmp(buf, "a") == 0 || strcmp(buf, "author") == 0) {
-    string_free(area);
-    printf("Search authors: ");
-    catalogue_search_avl(c->authors);
-  } else if (strcmp(buf, "l") == 0 || strcmp(buf, "lastname") == 0) {
-    string_free(area);
-    printf("Search authors: ");
-    catalogue_search_avl(c->authors_by_last_name);
-  } else if (strcmp(buf, "al") == 0 || strcmp(buf, "authorlast") == 0) {
-    string_free(area);
-    printf("Search author last names: ");
-    catalogue_search_avl(c->author_last_names);
-  } else if (strcmp(buf, "af") == 0 || strcmp(buf, "authorfirst") == 0) {
-    string_free(area);
-    printf("Search author first names: ");
-    catalogue_search_avl(c->author_first_names);
-  } else if (strcmp(buf, "p") == 0 || strcmp(buf, "pub") == 0) {
-    string_free(area);
-    printf("Search publishers: ");
-    catalogue_search_avl(c->publishers);
-  } else if (strcmp(buf, "y") == 0 || strcmp(buf, "year") == 0) {
-    printf("Year not implemented yet\n");
-  } else if (strcmp(buf, "c") == 0 || strcmp(buf, "cat") == 0) {
-    string_free(area);
-    printf("Search categories: ");
-    catalogue_search_avl(c->categories);
-  } else if (strcmp(buf, "lc") == 0 || strcmp(buf, "location") == 0) {
-    string_free(area);
-    printf("Search locations: ");
-    catalogue_search_avl(c->locations);
-  } else {
+  } else if (a == NULL) {
     printf("\nUnknown search area\n");
+  } else {
+    printf("Search %s: ", a->description);
+    catalogue_search_area(c, a, listing);
   }
+  string_free(area);
 }
 
-void catalogue_search_avl(const avl_t *avl) {
+int catalogue_search_book(const booknode_t *bn, void *state) {
+  writer_append_char(state, '\n');
+  print_book(&bn->book, state);
+  return 0;
+}
+
+void catalogue_search_area(catalogue_t *c, const search_area_t *area, const listing_t *listing) {
   string_t *s = file_read_line_alloc(stdin);
   trunc_string(s);
-  key_t key = key_from_string(s);
-  stack_t *stack = avl_get(avl, &key);
-  if (stack == NULL) return;
-  for (size_t b = 0; b < stack_size(stack); b++) {
-    booknode_t *bn = stack->values[b];
-    printf("\n");
-    print_book(&bn->book);
-  }
+  catalogue_build_indexes(c, search_area_bit(area));
+  uint64_t start = stats_now();
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  catalogue_find(c, area, s, listing, catalogue_search_book, w);
+  writer_free(w);
+  stats_record_since("search lookup", start);
+  string_free(s);
 }
 
 void print_search_help() {
@@ -721,10 +1655,17 @@ void print_search_help() {
   printf("                   with last name (e.g. 'Hinton, Matthew')\n");
   printf(" al, authorlast   search by author last name\n");
   printf(" af, authorfirst  search by author first name\n");
+  printf(" as, authorsound  search for authors by how their name sounds,\n");
+  printf("                   by last name alone or full name (e.g.\n");
+  printf("                   'Skryabin' finds 'Alexander Scriabin')\n");
   printf(" p,  pub          search for a publisher\n");
   printf(" y,  year         search by publication year\n");
   printf(" c,  cat          search for a category or list of categories\n");
   printf(" lc, location     search by location\n");
+  printf("End a search with '*' to match every entry starting with it,\n");
+  printf("or with '~' for entries within a few typos of it, closest first\n");
+  printf("('~1' to '~%d' sets the number of typos allowed); '\\*' and '\\~'\n", FUZZY_MAX_DISTANCE);
+  printf("at the end search for a literal '*' or '~'\n");
 }
 
 // write help message
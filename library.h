@@ -1,6 +1,7 @@
 #ifndef LIBRARY_H_
 #define LIBRARY_H_
 #include "better_string.h"
+#include "writer.h"
 
 typedef void(*freefunc_t)(void *);
 
@@ -25,6 +26,7 @@ extern const book_t DEFAULT_BOOK;
 
 typedef struct BOOKNODE_STRUCT {
   struct BOOKNODE_STRUCT *next;
+  uint32_t id;
   book_t book;
 } booknode_t;
 
@@ -37,21 +39,87 @@ typedef struct {
     KEY_STRING,
     KEY_INT
   } type;
+  // a borrowed key points into a book and is not freed with the index
+  bool borrowed;
   union {
     string_t *key;
     int ikey;
   };
 } key_t;
 
+typedef struct POOL_STRUCT pool_t;
+
+typedef struct ARENA_STRUCT arena_t;
+
+typedef struct INDEX_JOB_STRUCT index_job_t;
+
+typedef struct QUERY_CACHE_STRUCT query_cache_t;
+
+/*! Parses catalogue lines in place, reusing its string headers and
+  stacks from line to line. */
+typedef struct VIEW_PARSER_STRUCT view_parser_t;
+
+/*! Maps the catalogue's book ids back to its books. */
+typedef struct BOOKTABLE_STRUCT booktable_t;
+
+typedef struct POSTINGS_BLOCK_STRUCT postings_block_t;
+
+#define POSTINGS_INLINE 2
+
+/*! The books filed under one index key, in the order they were added.
+  Up to POSTINGS_INLINE books are held in place, more in an array of
+  their own, and large buckets as delta-encoded ascending book ids. */
+typedef struct {
+  uint32_t size;
+  enum {
+    POSTINGS_SMALL,
+    POSTINGS_ARRAY,
+    POSTINGS_PACKED
+  } kind;
+  union {
+    booknode_t *books[POSTINGS_INLINE];
+    booknode_t **array;
+    postings_block_t *packed;
+  };
+} postings_t;
+
+/*! A key and its books, shared by every copy of the node holding it. */
+typedef struct {
+  uintptr_t refs;
+  key_t key;
+  postings_t books;
+} avl_entry_t;
+
+/*! Nodes are reference counted so several tree versions can share them.
+  A node referenced more than once is copied before it is changed. */
 typedef struct AVL_STRUCT {
   struct AVL_STRUCT *left;
   struct AVL_STRUCT *right;
   uintptr_t height;
-  key_t key;
-  stack_t *data;
-  void(*freefunc)(void *);
+  // entries in this subtree, for walks starting at a rank
+  uintptr_t size;
+  uintptr_t refs;
+  avl_entry_t *entry;
 } avl_t;
 
+typedef struct {
+  uint64_t hash;
+  booknode_t *book;
+} bookset_entry_t;
+
+typedef struct {
+  bookset_entry_t *entries;
+  size_t capacity;
+  size_t size;
+} bookset_t;
+
+typedef int (*avl_walkfunc_t)(const key_t *k, const postings_t *books, void *state);
+
+typedef int (*bookfunc_t)(const booknode_t *bn, void *state);
+
+// takes the key over
+typedef void (*keyfunc_t)(key_t key, booknode_t *link, void *state);
+
 typedef struct {
   booksll_t booklist;
   avl_t *titles;
@@ -60,10 +128,25 @@ typedef struct {
   avl_t *authors_by_last_name;
   avl_t *author_last_names;
   avl_t *author_first_names;
+  avl_t *author_sounds;
   avl_t *publishers;
   avl_t *categories;
   avl_t *years;
   avl_t *locations;
+  bookset_t *books;
+  booktable_t *ids;
+  // the books of this version have ids below size; the table is shared
+  // with snapshots and goes on growing past it
+  uint32_t size;
+  pool_t *nodes;
+  arena_t *arena;
+  stack_t *buffers;
+  // one bit per SEARCH_AREAS entry whose index has been built
+  uint32_t indexes;
+  // indexes being built on background threads
+  index_job_t *jobs;
+  // recent searches, if the catalogue keeps them
+  query_cache_t *cache;
 } catalogue_t;
 
 typedef struct {
@@ -77,6 +160,52 @@ typedef struct {
   catalogue_t *catalogue;
 } library_t;
 
+typedef struct {
+  const char *shortname;
+  const char *name;
+  const char *description;
+  size_t index;
+  // calls keyfunc with each key the book is filed under in this area
+  void (*keys)(booknode_t *link, keyfunc_t keyfunc, void *state);
+  bool numeric;
+  // keys and queries are phonetic codes of author names
+  bool phonetic;
+} search_area_t;
+
+typedef enum {
+  LIST_DEFAULT,
+  LIST_ASCENDING,
+  LIST_DESCENDING
+} list_order_t;
+
+/*! A save of the whole catalogue, opened before a fork and written in
+  the child. */
+typedef struct {
+  const catalogue_t *catalogue;
+  const char *path;
+  string_t *tmp;
+  writer_t *w;
+} catalogue_save_t;
+
+/*! The part of a listing or search to print: limit entries (0 for all)
+  after skipping the first offset, in the given order. */
+typedef struct {
+  size_t offset;
+  size_t limit;
+  list_order_t order;
+} listing_t;
+
+// the most edits a fuzzy search ('~') can allow
+#define FUZZY_MAX_DISTANCE 3
+
+// every index, for catalogue_build_indexes
+#define CATALOGUE_ALL_INDEXES UINT32_MAX
+
+// the indexes built while loading unless --eager says otherwise
+#define CATALOGUE_EAGER_INDEXES "title,author"
+
+extern const search_area_t SEARCH_AREAS[];
+
 void stack_realloc(stack_t *s, size_t capacity);
 
 stack_t *stack_init(size_t capacity);
@@ -115,27 +244,37 @@ void book_free(book_t b);
 
 void trunc_string(string_t *s);
 
-void print_book(const book_t *book);
+void write_authors(stack_t *s, writer_t *w, const char *sep);
+
+void write_categories(stack_t *cat, writer_t *w, const char *sep);
+
+void print_book(const book_t *book, writer_t *w);
 
 bool read_book(book_t *bookptr);
 
-bool book_read_from_file(FILE *f, book_t *book);
+view_parser_t *view_parser_init();
 
-booknode_t *booknode_init();
+void view_parser_free(view_parser_t *vp);
 
-void booknode_free(booknode_t *bn);
+const book_t *book_parse_view(view_parser_t *vp, byte_t *line, size_t len);
 
-void booknode_print_all_books(booknode_t *bn);
+book_t book_copy_alloc(const book_t *view);
 
-void write_book_to_file(const book_t *book, FILE *f);
+booknode_t *booknode_pack(const book_t *book, arena_t *arena);
 
-void booknode_write_all_to_file(booknode_t *bn, FILE *f);
+void booknode_print_all_books(booknode_t *bn, writer_t *w);
+
+void write_book_to_file(const book_t *book, writer_t *w);
+
+void booknode_write_all_to_file(booknode_t *bn, writer_t *w);
+
+bool authors_equal(const stack_t *a1, const stack_t *a2);
 
 bool booknode_isbook(void *bn, void *);
 
-bool book_exists(stack_t *s);
+bool book_exists(const postings_t *books);
 
-booknode_t *booksll_add_book(booksll_t *booksll, book_t book);
+booknode_t *booksll_add_book(booksll_t *booksll, book_t book, arena_t *arena);
 
 void remove_book(booknode_t *bn);
 
@@ -143,37 +282,85 @@ catalogue_t *catalogue_init();
 
 void catalogue_add_book(catalogue_t *c, book_t book);
 
+bool catalogue_contains_book(const catalogue_t *c, const book_t *book);
+
+booknode_t *catalogue_book(const catalogue_t *c, uint32_t id);
+
+void catalogue_print_dupes(const catalogue_t *c);
+
 void catalogue_free(catalogue_t *c);
 
-void catalogue_print_all_books(catalogue_t *c);
+catalogue_t *catalogue_snapshot(const catalogue_t *c);
+
+void catalogue_snapshot_free(catalogue_t *snapshot);
+
+void catalogue_write_keys(const avl_t *avl, writer_t *w);
+
+void catalogue_print_keys(const avl_t *avl);
+
+bool listing_parse(const char *args, listing_t *listing);
+
+void catalogue_print_all_books(catalogue_t *c, const listing_t *listing);
+
+void catalogue_print_all_titles(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_titles(catalogue_t *c);
+void catalogue_print_all_subtitles(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_subtitles(catalogue_t *c);
+void catalogue_print_all_authors(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_authors(catalogue_t *c);
+void catalogue_print_all_authors_by_last_name(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_authors_by_last_name(catalogue_t *c);
+void catalogue_print_all_author_last_names(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_author_last_names(catalogue_t *c);
+void catalogue_print_all_author_first_names(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_author_first_names(catalogue_t *c);
+void catalogue_print_all_publishers(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_publishers(catalogue_t *c);
+void catalogue_print_all_years(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_years(catalogue_t *c);
+void catalogue_print_all_categories(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_categories(catalogue_t *c);
+void catalogue_print_all_locations(catalogue_t *c, const listing_t *listing);
 
-void catalogue_print_all_locations(catalogue_t *c);
+bool catalogue_save_open(catalogue_save_t *save, const catalogue_t *c, const char *path);
 
-void catalogue_write_to_file(catalogue_t *c, string_t *filename);
+int catalogue_save_write(catalogue_save_t *save);
+
+void catalogue_save_close(catalogue_save_t *save, bool discard);
+
+void catalogue_write_books_since(const catalogue_t *c, const booknode_t *since, writer_t *w);
+
+void catalogue_read_books(catalogue_t *c, FILE *f, bool (*func)(catalogue_t *, book_t, bool, void *), void *state);
 
 int catalogue_read_from_file(catalogue_t *c, string_t *filename);
 
-void catalogue_search(catalogue_t *c);
+int catalogue_import(catalogue_t *c, string_t *filename, writer_t *w);
+
+const search_area_t *search_area_find(const char *name);
+
+uint32_t search_area_bit(const search_area_t *area);
+
+bool catalogue_parse_indexes(const char *list, uint32_t *indexes);
+
+void catalogue_build_indexes(catalogue_t *c, uint32_t indexes);
+
+void catalogue_build_indexes_background(catalogue_t *c, uint32_t indexes);
+
+void catalogue_finish_indexes(catalogue_t *c, uint32_t indexes, bool block);
+
+void catalogue_print_indexes(const catalogue_t *c);
+
+avl_t *catalogue_area_index(const catalogue_t *c, const search_area_t *area);
+
+bool search_key(const search_area_t *area, const string_t *query, key_t *key, bool *prefix, int *distance);
+
+int catalogue_match(const catalogue_t *c, const search_area_t *area, const string_t *query, avl_walkfunc_t walkfunc, void *state);
+
+int catalogue_find(const catalogue_t *c, const search_area_t *area, const string_t *query, const listing_t *listing, bookfunc_t bookfunc, void *state);
+
+void catalogue_search(catalogue_t *c, const listing_t *listing);
 
-void catalogue_search_avl(const avl_t *avl);
+void catalogue_search_area(catalogue_t *c, const search_area_t *area, const listing_t *listing);
 
 void print_search_help();
 
@@ -2,115 +2,366 @@
 #include <string.h>
 #include "macros.h"
 #include "library.h"
+#include "stats.h"
+#include "query.h"
+#include "server.h"
+#include "proc.h"
+#include "cache.h"
+#include "federation.h"
 
-bool add_book(library_t *library, FILE *f) {
+/* Background save: a forked child writes the copy-on-write image of the
+   catalogue to a temporary file and renames it over the catalogue file
+   while the REPL carries on. Books added meanwhile are appended to the
+   old file and appended again to the new one once the child is done.
+   The file and buffer are set up before the fork, since the index and
+   persistence threads may hold malloc or stdio locks at that moment. */
+typedef struct {
+  int pid;
+  const char *path;
+  catalogue_save_t file;
+  const booknode_t *head;
+  uint64_t start;
+} bgsave_t;
+
+int bgsave_child(void *arg) {
+  bgsave_t *save = arg;
+  return catalogue_save_write(&save->file);
+}
+
+void bgsave_start(bgsave_t *save, const library_t *library) {
+  if (save->pid > 0) {
+    printf("A background save is already running\n");
+    return;
+  }
+  if (!catalogue_save_open(&save->file, library->catalogue, save->path)) {
+    printf("Could not start a background save\n");
+    return;
+  }
+  save->head = library->catalogue->booklist.head;
+  save->start = stats_now();
+  int pid = proc_spawn(bgsave_child, save);
+  catalogue_save_close(&save->file, pid < 0);
+  if (pid < 0) {
+    printf("Could not start a background save\n");
+    return;
+  }
+  save->pid = pid;
+}
+
+// reports a finished save and moves the writer over to the new file
+void bgsave_finish(bgsave_t *save, const library_t *library, writer_t *w, bool block) {
+  if (save->pid <= 0) return;
+  int status = proc_wait(save->pid, block);
+  if (status < 0) return;
+  save->pid = 0;
+  stats_record_since("bgsave", save->start);
+  double seconds = (stats_now() - save->start) / 1e9;
+  if (status != 0) {
+    printf("Background save of %s failed after %.3f s\n", save->path, seconds);
+    return;
+  }
+  writer_flush(w);
+  FILE *f = fopen(save->path, "a");
+  if (f == NULL) die("could not reopen catalogue file");
+  persist_reopen(w->persist, f);
+  catalogue_write_books_since(library->catalogue, save->head, w);
+  writer_flush(w);
+  printf("Background save of %s finished in %.3f s\n", save->path, seconds);
+}
+
+/* A catalogue file of one branch. Each branch has a writer and
+   background save of its own, so books added to it only go to its file;
+   searches run across every branch. */
+typedef struct {
+  const char *path;
+  library_t library;
+  persist_t *persist;
+  writer_t *w;
+  bgsave_t save;
+} branch_t;
+
+typedef struct {
+  branch_t *branches;
+  size_t size;
+  size_t active;
+  // the catalogues and paths of the branches, as searches take them
+  catalogue_t **catalogues;
+  const char **paths;
+} branches_t;
+
+bool add_book(library_t *library, writer_t *w) {
   if (library == NULL) die("add_book(): library was null");
   book_t book;
   if (read_book(&book) == false)
     return false;
-  write_book_to_file(&book, f);
-  fflush(f);
+  if (catalogue_contains_book(library->catalogue, &book)) {
+    printf("This book is already in the catalogue\n");
+    book_free(book);
+    return true;
+  }
+  write_book_to_file(&book, w);
+  writer_flush(w);
   catalogue_add_book(library->catalogue, book);
   return true;
 }
 
-void add_books(library_t *library, FILE *f) {
+void add_books(library_t *library, writer_t *w) {
+  uint64_t start = stats_now();
+  size_t added = 0;
   while (true) {
     printf("\n");
-    if (add_book(library, f) == false) {
-      printf("Are you sure you want to exit? [y/n]: ");
-      string_t *answer = file_read_line_alloc(stdin);
-      trunc_string(answer);
-      bool y   = strcmp((char *)answer->value, "y") == 0;
-      bool yes = strcmp((char *)answer->value, "yes") == 0;
-      string_free(answer);
-      if (y || yes) return;
+    if (add_book(library, w)) {
+      added++;
+      continue;
     }
+    printf("Are you sure you want to exit? [y/n]: ");
+    string_t *answer = file_read_line_alloc(stdin);
+    trunc_string(answer);
+    bool y   = strcmp((char *)answer->value, "y") == 0;
+    bool yes = strcmp((char *)answer->value, "yes") == 0;
+    string_free(answer);
+    if (y || yes) break;
   }
+  double seconds = (stats_now() - start) / 1e9;
+  printf("Added %zu books in %.3f s (%.1f books/s)\n", added, seconds,
+         seconds > 0 ? added / seconds : 0.0);
 }
 
+/* The startup listing is the book list alone, which needs no index, so
+   the prompt comes up while the indexes build behind it; the listing
+   commands print the indexes once they are wanted. */
 void print_catalogue(const library_t *library) {
   printf("%sBooks:%s\n", BWHT, CRESET);
-  catalogue_print_all_books(library->catalogue);
-  printf("\n%sTitles:%s\n", BWHT, CRESET);
-  catalogue_print_all_titles(library->catalogue);
-  printf("\n%sSubtitles:%s\n", BWHT, CRESET);
-  catalogue_print_all_subtitles(library->catalogue);
-  printf("\n%sAuthors:%s\n", BWHT, CRESET);
-  catalogue_print_all_authors(library->catalogue);
-  printf("\n%sAuthors by Last Name:%s\n", BWHT, CRESET);
-  catalogue_print_all_authors_by_last_name(library->catalogue);
-  printf("\n%sAuthor Last Names:%s\n", BWHT, CRESET);
-  catalogue_print_all_author_last_names(library->catalogue);
-  printf("\n%sAuthor First Names:%s\n", BWHT, CRESET);
-  catalogue_print_all_author_first_names(library->catalogue);
-  printf("\n%sPublishers:%s\n", BWHT, CRESET);
-  catalogue_print_all_publishers(library->catalogue);
-  printf("\n%sYears:%s\n", BWHT, CRESET);
-  catalogue_print_all_years(library->catalogue);
-  printf("\n%sCategories:%s\n", BWHT, CRESET);
-  catalogue_print_all_categories(library->catalogue);
+  catalogue_print_all_books(library->catalogue, NULL);
+  printf("\nt, st, a, l, al, af, p, y and c list the titles, subtitles, authors,\n");
+  printf("authors by last name, last and first names, publishers, years and categories\n");
+}
+
+// alias -> name used when recording per-command latency
+static const char *COMMAND_NAMES[][2] = {
+  { "q", "quit" }, { "h", "help" }, { "b", "books" }, { "t", "titles" },
+  { "st", "subtitles" }, { "a", "authors" }, { "l", "lastname" },
+  { "al", "authorlast" }, { "af", "authorfirst" }, { "p", "pub" },
+  { "y", "years" }, { "c", "cat" }, { "add", "add" },
+  { "add books", "addbooks" }, { "s", "search" }, { "save", "save" },
+  { "dupes", "dupes" }, { "mem", "mem" }
+};
+
+const char *command_name(const char *buf) {
+  for (size_t i = 0; i < sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]); i++) {
+    if (strcmp(buf, COMMAND_NAMES[i][0]) == 0 || strcmp(buf, COMMAND_NAMES[i][1]) == 0)
+      return COMMAND_NAMES[i][1];
+  }
+  // a listing with options
+  listing_t listing;
+  const char *space = strchr(buf, ' ');
+  if (space != NULL && listing_parse(space + 1, &listing)) {
+    for (size_t i = 0; i < sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]); i++) {
+      for (int alias = 0; alias < 2; alias++) {
+        size_t len = strlen(COMMAND_NAMES[i][alias]);
+        if (len == (size_t)(space - buf) && strncmp(buf, COMMAND_NAMES[i][alias], len) == 0)
+          return COMMAND_NAMES[i][1];
+      }
+    }
+  }
+  if (strncmp(buf, "stats", 5) == 0) return "stats";
+  if (strncmp(buf, "import", 6) == 0) return "import";
+  if (strncmp(buf, "use", 3) == 0) return "use";
+  return "unknown";
+}
+
+void print_stats(const char *args) {
+  while (*args == ' ') args++;
+  if (*args == '\0') {
+    writer_t *out = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+    stats_print(out);
+    writer_free(out);
+    return;
+  }
+  if (strncmp(args, "json", 4) != 0) {
+    printf("Usage: stats [json [file]]\n");
+    return;
+  }
+  args += 4;
+  while (*args == ' ') args++;
+  FILE *f = *args == '\0' ? stdout : fopen(args, "w");
+  if (f == NULL) {
+    printf("could not open file\n");
+    return;
+  }
+  writer_t *out = writer_init(f, WRITER_DEFAULT_CAPACITY);
+  stats_write_json(out);
+  writer_free(out);
+  if (f != stdout) fclose(f);
 }
 
-bool command(const string_t *cmd, library_t *library, FILE *f) {
+// "use" lists the branches, "use N" or "use FILE" picks the one added books go to
+void use_branch(branches_t *branches, const char *args) {
+  while (*args == ' ') args++;
+  if (*args == '\0') {
+    for (size_t i = 0; i < branches->size; i++)
+      printf("%c %zu %s\n", i == branches->active ? '*' : ' ', i + 1, branches->paths[i]);
+    return;
+  }
+  for (size_t i = 0; i < branches->size; i++) {
+    char number[24];
+    snprintf(number, sizeof(number), "%zu", i + 1);
+    if (strcmp(args, number) == 0 || strcmp(args, branches->paths[i]) == 0) {
+      branches->active = i;
+      printf("Adding books to %s\n", branches->paths[i]);
+      return;
+    }
+  }
+  printf("No such branch\n");
+}
+
+bool command(const string_t *cmd, branches_t *branches) {
   if (cmd->len == 0) return false;
+  branch_t *branch = &branches->branches[branches->active];
+  library_t *library = &branch->library;
+  writer_t *w = branch->w;
+  bgsave_t *save = &branch->save;
   const char *buf = (char *)cmd->value;
+  // listings and searches take "limit N", "offset M", "asc" or "desc" after the command
+  listing_t listing;
+  listing_parse("", &listing);
+  char name[16];
+  const char *space = strchr(buf, ' ');
+  if (space != NULL && (size_t)(space - buf) < sizeof(name) && listing_parse(space + 1, &listing)) {
+    memcpy(name, buf, space - buf);
+    name[space - buf] = '\0';
+    buf = name;
+  }
   if (strcmp(buf, "q") == 0 || strcmp(buf, "quit") == 0) {
     return true;
   } else if (strcmp(buf, "h") == 0 || strcmp(buf, "help") == 0) {
     print_help();
   } else if (strcmp(buf, "b") == 0 || strcmp(buf, "books") == 0) {
     printf("%sBooks:%s\n", BWHT, CRESET);
-    catalogue_print_all_books(library->catalogue);
+    catalogue_print_all_books(library->catalogue, &listing);
   } else if (strcmp(buf, "t") == 0 || strcmp(buf, "titles") == 0) {
     printf("%sTitles:%s\n", BWHT, CRESET);
-    catalogue_print_all_titles(library->catalogue);
+    catalogue_print_all_titles(library->catalogue, &listing);
   } else if (strcmp(buf, "st") == 0 || strcmp(buf, "subtitles") == 0) {
     printf("%sSubtitles:%s\n", BWHT, CRESET);
-    catalogue_print_all_subtitles(library->catalogue);
+    catalogue_print_all_subtitles(library->catalogue, &listing);
   } else if (strcmp(buf, "a") == 0 || strcmp(buf, "authors") == 0) {
     printf("%sAuthors:%s\n", BWHT, CRESET);
-    catalogue_print_all_authors(library->catalogue);
+    catalogue_print_all_authors(library->catalogue, &listing);
   } else if (strcmp(buf, "l") == 0 || strcmp(buf, "lastname") == 0) {
     printf("%sAuthors by Last Name:%s\n", BWHT, CRESET);
-    catalogue_print_all_authors_by_last_name(library->catalogue);
+    catalogue_print_all_authors_by_last_name(library->catalogue, &listing);
   } else if (strcmp(buf, "al") == 0 || strcmp(buf, "authorlast") == 0) {
     printf("%sAuthor Last Names:%s\n", BWHT, CRESET);
-    catalogue_print_all_author_last_names(library->catalogue);
+    catalogue_print_all_author_last_names(library->catalogue, &listing);
   } else if (strcmp(buf, "af") == 0 || strcmp(buf, "authorfirst") == 0) {
     printf("%sAuthor First Names:%s\n", BWHT, CRESET);
-    catalogue_print_all_author_first_names(library->catalogue);
+    catalogue_print_all_author_first_names(library->catalogue, &listing);
   } else if (strcmp(buf, "p") == 0 || strcmp(buf, "pub") == 0) {
     printf("%sPublishers:%s\n", BWHT, CRESET);
-    catalogue_print_all_publishers(library->catalogue);
+    catalogue_print_all_publishers(library->catalogue, &listing);
   } else if (strcmp(buf, "y") == 0 || strcmp(buf, "years") == 0) {
     printf("%sYears:%s\n", BWHT, CRESET);
-    catalogue_print_all_years(library->catalogue);
+    catalogue_print_all_years(library->catalogue, &listing);
   } else if (strcmp(buf, "c") == 0 || strcmp(buf, "cat") == 0) {
     printf("%sCategories:%s\n", BWHT, CRESET);
-    catalogue_print_all_categories(library->catalogue);
+    catalogue_print_all_categories(library->catalogue, &listing);
   } else if (strcmp(buf, "add") == 0) {
-    add_book(library, f);
+    add_book(library, w);
   } else if (strcmp(buf, "addbooks") == 0 || strcmp(buf, "add books") == 0) {
-    add_books(library, f);
+    add_books(library, w);
   } else if (strcmp(buf, "s") == 0 || strcmp(buf, "search") == 0) {
-    catalogue_search(library->catalogue);
+    if (branches->size > 1)
+      federation_search(branches->catalogues, branches->paths, branches->size, &listing);
+    else
+      catalogue_search(library->catalogue, &listing);
+  } else if (strcmp(buf, "use") == 0 || strncmp(buf, "use ", 4) == 0) {
+    use_branch(branches, buf + 3);
+  } else if (strcmp(buf, "dupes") == 0) {
+    catalogue_print_dupes(library->catalogue);
+  } else if (strcmp(buf, "mem") == 0) {
+    catalogue_print_indexes(library->catalogue);
+  } else if (strcmp(buf, "save") == 0) {
+    bgsave_start(save, library);
+  } else if (strncmp(buf, "import ", 7) == 0) {
+    string_t *filename = string_from_alloc(buf + 7);
+    catalogue_import(library->catalogue, filename, w);
+    string_free(filename);
+  } else if (strcmp(buf, "stats") == 0 || strncmp(buf, "stats ", 6) == 0) {
+    print_stats(buf + 5);
   } else {
     printf("\nUnknown command\n");
   }
   return false;
 }
 
-int main(int argc, char **argv) {
-  if (argc > 2) {
-    printf("Too many arguments\n");
-    return 1;
+void import_all(library_t *library, stack_t *imports, writer_t *w) {
+  for (size_t i = 0; i < stack_size(imports); i++) {
+    string_t *filename = string_from_alloc(imports->values[i]);
+    catalogue_import(library->catalogue, filename, w);
+    string_free(filename);
   }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "query") == 0)
+    return query_main(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "export") == 0)
+    return export_main(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "serve") == 0)
+    return server_main(argc, argv);
 
-  library_t library = { LIB_OK, NULL };
-  library.catalogue = catalogue_init();
+  stack_t *paths = stack_init(0);
+  stack_t *imports = stack_init(0);
+  persist_config_t durability = PERSIST_CONFIG_DEFAULT;
+  uint32_t eager;
+  catalogue_parse_indexes(CATALOGUE_EAGER_INDEXES, &eager);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--import") == 0) {
+      if (++i == argc) {
+        printf("%s needs a file to import\n", argv[i - 1]);
+        return 1;
+      }
+      stack_push(imports, argv[i]);
+    } else if (strcmp(argv[i], "--durability") == 0) {
+      if (++i == argc || !persist_policy_parse(argv[i], &durability.policy)) {
+        printf("--durability needs one of none, batch or always\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--batch-records") == 0 || strcmp(argv[i], "--batch-ms") == 0) {
+      unsigned long n = 0;
+      if (++i < argc && argv[i][strspn(argv[i], "0123456789")] == '\0') n = strtoul(argv[i], NULL, 10);
+      if (n == 0) {
+        printf("%s needs a positive number\n", argv[i - 1]);
+        return 1;
+      }
+      if (strcmp(argv[i - 1], "--batch-ms") == 0) durability.batch_ms = n;
+      else durability.batch_records = n;
+    } else if (strcmp(argv[i], "--eager") == 0) {
+      if (++i == argc || !catalogue_parse_indexes(argv[i], &eager)) {
+        printf("--eager needs all, none or a comma separated list of search areas\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-") == 0) {
+      printf("The catalogue must be a file; --import - merges books from stdin\n");
+      return 1;
+    } else {
+      // one catalogue file per branch
+      for (size_t j = 0; j < stack_size(paths); j++) {
+        if (strcmp(paths->values[j], argv[i]) == 0) {
+          printf("%s is given twice\n", argv[i]);
+          return 1;
+        }
+      }
+      stack_push(paths, argv[i]);
+    }
+  }
 
-  if (argc == 1) {
+  if (stack_size(paths) == 0) {
+    stack_free(paths, nofree);
+    library_t library = { LIB_OK, NULL };
+    library.catalogue = catalogue_init();
+    library.catalogue->cache = query_cache_init(QUERY_CACHE_CAPACITY);
     printf("File to store library catalogue in: ");
     string_t *filename = file_read_line_alloc(stdin);
     trunc_string(filename);
@@ -120,38 +371,91 @@ int main(int argc, char **argv) {
       printf("could not open file\n");
       return 1;
     }
-    add_books(&library, f);
-    fclose(f);
+    persist_t *p = persist_init(f, &durability);
+    writer_t *w = writer_init_persist(p, WRITER_DEFAULT_CAPACITY);
+    catalogue_build_indexes(library.catalogue, eager);
+    import_all(&library, imports, w);
+    stack_free(imports, nofree);
+    add_books(&library, w);
+    writer_free(w);
+    int err = persist_free(p);
     catalogue_free(library.catalogue);
-    return 0;
+    return err;
   }
 
-  string_t *filename = string_from_alloc(argv[1]);
-  RET_IF(catalogue_read_from_file(library.catalogue, filename));
-  string_free(filename);
+  branches_t branches = { NULL, stack_size(paths), 0, NULL, NULL };
+  branches.branches = calloc(branches.size, sizeof(branch_t));
+  branches.catalogues = calloc(branches.size, sizeof(catalogue_t *));
+  branches.paths = calloc(branches.size, sizeof(char *));
+  if (branches.branches == NULL || branches.catalogues == NULL || branches.paths == NULL)
+    die("out of memory");
+  for (size_t i = 0; i < branches.size; i++) {
+    branch_t *b = &branches.branches[i];
+    b->path = paths->values[i];
+    b->library = (library_t){ LIB_OK, catalogue_init() };
+    b->library.catalogue->cache = query_cache_init(QUERY_CACHE_CAPACITY);
+    branches.catalogues[i] = b->library.catalogue;
+    branches.paths[i] = b->path;
 
-  FILE *f = fopen(argv[1], "w");
-  if (f == NULL) {
-    printf("could not open file for writing\n");
-    return 1;
+    string_t *filename = string_from_alloc(b->path);
+    RET_IF(catalogue_read_from_file(b->library.catalogue, filename));
+    string_free(filename);
+
+    FILE *f = fopen(b->path, "a");
+    if (f == NULL) {
+      printf("could not open %s for writing\n", b->path);
+      return 1;
+    }
+    b->persist = persist_init(f, &durability);
+    b->w = writer_init_persist(b->persist, WRITER_DEFAULT_CAPACITY);
+    // rewrite the file in the background rather than before the first prompt
+    b->save = (bgsave_t){ .pid = 0, .path = b->path };
+    bgsave_start(&b->save, &b->library);
   }
-  booknode_write_all_to_file(library.catalogue->booklist.head, f);
-  fflush(f);
+  stack_free(paths, nofree);
+
+  // imports go to the first branch
+  import_all(&branches.branches[0].library, imports, branches.branches[0].w);
+  stack_free(imports, nofree);
 
-  print_catalogue(&library);
+  for (size_t i = 0; i < branches.size; i++) {
+    if (branches.size > 1) printf("%s%sBranch %s%s\n\n", i > 0 ? "\n" : "", BWHT, branches.paths[i], CRESET);
+    print_catalogue(&branches.branches[i].library);
+  }
+  // books first, indexes behind the prompt
+  for (size_t i = 0; i < branches.size; i++)
+    catalogue_build_indexes_background(branches.catalogues[i], eager);
 
   // command loop
   while (true) {
     printf("\n>>> ");
     string_t *cmd = file_read_line_alloc(stdin);
     trunc_string(cmd);
-    bool done = command(cmd, &library, f);
+    uint64_t start = stats_now();
+    // the end of input, as after --import -, quits like q
+    bool done = command(cmd, &branches) || feof(stdin);
+    if (cmd->len > 0)
+      stats_record_since(command_name((char *)cmd->value), start);
     string_free(cmd);
+    for (size_t i = 0; i < branches.size; i++) {
+      branch_t *b = &branches.branches[i];
+      bgsave_finish(&b->save, &b->library, b->w, false);
+      catalogue_finish_indexes(b->library.catalogue, CATALOGUE_ALL_INDEXES, false);
+    }
     if (done) break;
   }
 
-  fclose(f);
-  catalogue_free(library.catalogue);
+  int err = 0;
+  for (size_t i = 0; i < branches.size; i++) {
+    branch_t *b = &branches.branches[i];
+    bgsave_finish(&b->save, &b->library, b->w, true);
+    writer_free(b->w);
+    err |= persist_free(b->persist);
+    catalogue_free(b->library.catalogue);
+  }
+  free(branches.branches);
+  free(branches.catalogues);
+  free(branches.paths);
 
-  return 0;
+  return err;
 }
@@ -0,0 +1,268 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "persist.h"
+#include "writer.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Group commit: callers push finished records onto a bounded lock-free
+   queue (Vyukov's, multi-producer, single consumer) and carry on. One
+   writer thread takes everything queued, writes it with a single flush
+   and fsyncs according to the durability policy. Callers only block
+   when the queue is full or the policy is "always". */
+
+typedef struct {
+  _Atomic size_t seq;
+  byte_t *data;
+  size_t len;
+} persist_cell_t;
+
+struct PERSIST_STRUCT {
+  FILE *file;
+  writer_t *w;
+  persist_config_t config;
+  pthread_t thread;
+  pthread_mutex_t file_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  _Atomic bool sleeping;
+  _Atomic bool stopping;
+  _Atomic bool error;
+  _Atomic size_t tail;
+  size_t head;
+  _Atomic size_t written;
+  _Atomic size_t synced;
+  persist_cell_t cells[PERSIST_QUEUE_CAPACITY];
+};
+
+static const char *POLICY_NAMES[] = {
+  [PERSIST_NONE] = "none",
+  [PERSIST_BATCH] = "batch",
+  [PERSIST_ALWAYS] = "always"
+};
+
+bool persist_policy_parse(const char *name, persist_policy_t *policy) {
+  for (size_t i = 0; i < sizeof(POLICY_NAMES) / sizeof(POLICY_NAMES[0]); i++) {
+    if (strcmp(name, POLICY_NAMES[i]) == 0) {
+      *policy = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *persist_policy_name(persist_policy_t policy) {
+  return POLICY_NAMES[policy];
+}
+
+bool persist_queue_empty(persist_t *p) {
+  persist_cell_t *cell = &p->cells[p->head % PERSIST_QUEUE_CAPACITY];
+  return atomic_load(&cell->seq) != p->head + 1;
+}
+
+// writes everything queued in one flush, returns the number of records
+size_t persist_write_batch(persist_t *p) {
+  size_t n = 0;
+  uint64_t start = stats_now();
+  pthread_mutex_lock(&p->file_lock);
+  while (n < PERSIST_QUEUE_CAPACITY && !persist_queue_empty(p)) {
+    persist_cell_t *cell = &p->cells[p->head % PERSIST_QUEUE_CAPACITY];
+    writer_append_n(p->w, cell->data, cell->len);
+    free(cell->data);
+    atomic_store(&cell->seq, p->head + PERSIST_QUEUE_CAPACITY);
+    p->head++;
+    n++;
+  }
+  if (n > 0) {
+    if (writer_flush(p->w)) atomic_store(&p->error, true);
+    atomic_store(&p->written, p->head);
+    stats_count(STAT_PERSIST_RECORDS, n);
+    stats_count(STAT_PERSIST_BATCHES, 1);
+    stats_record_since("persist batch", start);
+  }
+  pthread_mutex_unlock(&p->file_lock);
+  return n;
+}
+
+void persist_fsync(persist_t *p) {
+  uint64_t start = stats_now();
+  pthread_mutex_lock(&p->file_lock);
+  if (fsync(fileno(p->file)) != 0) atomic_store(&p->error, true);
+  atomic_store(&p->synced, atomic_load(&p->written));
+  pthread_mutex_unlock(&p->file_lock);
+  stats_count(STAT_PERSIST_FSYNCS, 1);
+  stats_record_since("persist fsync", start);
+}
+
+void persist_notify(persist_t *p) {
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_broadcast(&p->done);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void *persist_thread(void *arg) {
+  persist_t *p = arg;
+  size_t unsynced = 0;
+  uint64_t last_sync = stats_now();
+  uint64_t last_write = 0;
+  while (true) {
+    size_t n = persist_write_batch(p);
+    unsynced += n;
+    bool due = unsynced > 0 && (p->config.policy == PERSIST_ALWAYS
+      || (p->config.policy == PERSIST_BATCH && (unsynced >= p->config.batch_records
+          || stats_now() - last_sync >= p->config.batch_ms * 1000000ull)));
+    if (due) {
+      persist_fsync(p);
+      unsynced = 0;
+      last_sync = stats_now();
+    }
+    if (n > 0 || due) persist_notify(p);
+    if (n > 0) {
+      last_write = stats_now();
+      continue;
+    }
+    // linger briefly so a busy producer does not pay for a wakeup per record
+    if (stats_now() - last_write < PERSIST_LINGER_US * 1000ull) {
+      sched_yield();
+      continue;
+    }
+
+    // sleep until a record arrives, or the next batch fsync is due
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->sleeping, true);
+    if (persist_queue_empty(p) && !atomic_load(&p->stopping)) {
+      if (p->config.policy == PERSIST_BATCH && unsynced > 0) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += p->config.batch_ms / 1000;
+        until.tv_nsec += p->config.batch_ms % 1000 * 1000000l;
+        until.tv_sec += until.tv_nsec / 1000000000l;
+        until.tv_nsec %= 1000000000l;
+        pthread_cond_timedwait(&p->wake, &p->lock, &until);
+      } else {
+        pthread_cond_wait(&p->wake, &p->lock);
+      }
+    }
+    atomic_store(&p->sleeping, false);
+    bool stop = atomic_load(&p->stopping) && persist_queue_empty(p);
+    pthread_mutex_unlock(&p->lock);
+    if (stop) break;
+  }
+  if (unsynced > 0 && p->config.policy != PERSIST_NONE) persist_fsync(p);
+  persist_notify(p);
+  return NULL;
+}
+
+void persist_wake(persist_t *p) {
+  if (!atomic_load(&p->sleeping)) return;
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void persist_wait(persist_t *p, _Atomic size_t *counter, size_t target) {
+  pthread_mutex_lock(&p->lock);
+  while (atomic_load(counter) < target)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// takes ownership of f, which is closed by persist_free
+persist_t *persist_init(FILE *f, const persist_config_t *config) {
+  if (f == NULL) die("persist_init(): file was null");
+  if (config == NULL) die("persist_init(): config was null");
+  persist_t *p = calloc(1, sizeof(persist_t));
+  if (p == NULL) die("out of memory");
+  p->file = f;
+  p->w = writer_init(f, WRITER_DEFAULT_CAPACITY);
+  p->config = *config;
+  for (size_t i = 0; i < PERSIST_QUEUE_CAPACITY; i++)
+    atomic_init(&p->cells[i].seq, i);
+  pthread_mutex_init(&p->file_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+  if (pthread_create(&p->thread, NULL, persist_thread, p) != 0) die("could not start persistence thread");
+  return p;
+}
+
+// copies data into the queue
+void persist_push(persist_t *p, const void *data, size_t len) {
+  if (p == NULL) die("persist_push(): persist was null");
+  if (len == 0) return;
+  byte_t *copy = malloc(len);
+  if (copy == NULL) die("out of memory");
+  memcpy(copy, data, len);
+  size_t pos = atomic_load(&p->tail);
+  persist_cell_t *cell;
+  while (true) {
+    cell = &p->cells[pos % PERSIST_QUEUE_CAPACITY];
+    size_t seq = atomic_load(&cell->seq);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak(&p->tail, &pos, pos + 1)) break;
+    } else if (seq < pos) {
+      // full: let the writer thread catch up
+      persist_wake(p);
+      sched_yield();
+      pos = atomic_load(&p->tail);
+    } else {
+      pos = atomic_load(&p->tail);
+    }
+  }
+  cell->data = copy;
+  cell->len = len;
+  atomic_store(&cell->seq, pos + 1);
+  persist_wake(p);
+  if (p->config.policy == PERSIST_ALWAYS)
+    persist_wait(p, &p->synced, pos + 1);
+}
+
+// waits until everything pushed so far has been written to the file
+int persist_sync(persist_t *p) {
+  size_t target = atomic_load(&p->tail);
+  persist_wake(p);
+  persist_wait(p, &p->written, target);
+  return atomic_load(&p->error);
+}
+
+// moves future writes to f, closing the current file
+int persist_reopen(persist_t *p, FILE *f) {
+  if (f == NULL) die("persist_reopen(): file was null");
+  persist_sync(p);
+  pthread_mutex_lock(&p->file_lock);
+  if (p->config.policy != PERSIST_NONE && fsync(fileno(p->file)) != 0) atomic_store(&p->error, true);
+  if (fclose(p->file) != 0) atomic_store(&p->error, true);
+  p->file = f;
+  p->w->file = f;
+  pthread_mutex_unlock(&p->file_lock);
+  return atomic_load(&p->error);
+}
+
+bool persist_error(persist_t *p) {
+  return atomic_load(&p->error);
+}
+
+int persist_free(persist_t *p) {
+  if (p == NULL) return 0;
+  persist_sync(p);
+  pthread_mutex_lock(&p->lock);
+  atomic_store(&p->stopping, true);
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+  if (writer_free(p->w)) atomic_store(&p->error, true);
+  if (fclose(p->file) != 0) atomic_store(&p->error, true);
+  int err = atomic_load(&p->error);
+  pthread_mutex_destroy(&p->file_lock);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->done);
+  free(p);
+  return err;
+}
@@ -0,0 +1,53 @@
+#ifndef PERSIST_H_
+#define PERSIST_H_
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "better_string.h"
+
+#define PERSIST_QUEUE_CAPACITY 4096
+// the default batch limits, see persist_config_t
+#define PERSIST_BATCH_RECORDS 256
+#define PERSIST_BATCH_MS 100
+// how long the writer thread keeps polling for more records before it sleeps
+#define PERSIST_LINGER_US 200
+
+/*! How long an appended record may sit only in the page cache:
+  none   - never fsync, leave it to the operating system
+  batch  - fsync every batch_records records or batch_ms milliseconds
+  always - fsync every batch and return from persist_push only after it */
+typedef enum {
+  PERSIST_NONE,
+  PERSIST_BATCH,
+  PERSIST_ALWAYS
+} persist_policy_t;
+
+/*! The durability policy and, for PERSIST_BATCH, how many records or
+  milliseconds may go by before the next fsync. */
+typedef struct {
+  persist_policy_t policy;
+  size_t batch_records;
+  unsigned long batch_ms;
+} persist_config_t;
+
+#define PERSIST_CONFIG_DEFAULT { PERSIST_BATCH, PERSIST_BATCH_RECORDS, PERSIST_BATCH_MS }
+
+typedef struct PERSIST_STRUCT persist_t;
+
+persist_t *persist_init(FILE *f, const persist_config_t *config);
+
+int persist_free(persist_t *p);
+
+bool persist_policy_parse(const char *name, persist_policy_t *policy);
+
+const char *persist_policy_name(persist_policy_t policy);
+
+void persist_push(persist_t *p, const void *data, size_t len);
+
+int persist_sync(persist_t *p);
+
+int persist_reopen(persist_t *p, FILE *f);
+
+bool persist_error(persist_t *p);
+
+#endif // PERSIST_H_
@@ -0,0 +1,200 @@
+#include <string.h>
+#include <ctype.h>
+#include "phonetic.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Author names reach the catalogue in several spellings and
+   transliterations ("Scriabin" and "Skryabin", "Tchaikovsky" and
+   "Tschaikowsky"), so the authorsound area files each author under the
+   sounds of their names instead of their letters. The encoding follows
+   Metaphone: vowels are dropped past the first letter, voiced and
+   unvoiced consonants share a code (B and P, D and T, V, W and F) and
+   the digraphs transliterations disagree on (CH, TCH, SCH, KH, CZ, SZ)
+   all become one sound, X. A key is the code of the last name, a comma
+   and the code of the first name, so a search is an index lookup: an
+   exact one for a full name, a prefix one for a last name alone. */
+
+#define PHONETIC_MAX_LETTERS 64
+
+bool phonetic_vowel(char c) {
+  return c != '\0' && strchr("AEIOUY", c) != NULL;
+}
+
+bool phonetic_front_vowel(char c) {
+  return c == 'E' || c == 'I' || c == 'Y';
+}
+
+// the code of one name, returning its length
+size_t phonetic_encode(const byte_t *name, size_t len, char code[PHONETIC_MAX_LENGTH + 1]) {
+  // upper-cased ASCII letters, anything else (hyphens, accents) skipped
+  char s[PHONETIC_MAX_LETTERS + 3] = { 0 };
+  size_t n = 0;
+  for (size_t i = 0; i < len && n < PHONETIC_MAX_LETTERS; i++)
+    if (name[i] < 0x80 && isalpha(name[i])) s[n++] = toupper(name[i]);
+  size_t size = 0;
+  for (size_t i = 0; i < n && size < PHONETIC_MAX_LENGTH; i++) {
+    char c = s[i], next = s[i + 1], sound = '\0';
+    // doubled letters sound once
+    if (i > 0 && c == s[i - 1]) continue;
+    switch (c) {
+      case 'A': case 'E': case 'I': case 'O': case 'U': case 'Y':
+        if (i == 0) sound = 'A';
+        break;
+      case 'B':
+        sound = 'P';
+        break;
+      case 'C':
+        if (next == 'H' || next == 'Z') {
+          sound = 'X';
+          i++;
+        } else if (phonetic_front_vowel(next)) {
+          sound = 'S';
+        } else {
+          sound = 'K';
+        }
+        break;
+      case 'D':
+        if (next == 'J') break;
+        if (next == 'G' && phonetic_front_vowel(s[i + 2])) {
+          sound = 'J';
+          i++;
+        } else {
+          sound = 'T';
+        }
+        break;
+      case 'G':
+        if (next == 'H') {
+          // silent unless a vowel follows, as in "Ghent"
+          if (phonetic_vowel(s[i + 2])) sound = 'K';
+          i++;
+        } else if (next == 'N' && s[i + 2] == '\0') {
+          break;
+        } else if (phonetic_front_vowel(next)) {
+          sound = 'J';
+        } else {
+          sound = 'K';
+        }
+        break;
+      case 'H':
+        if (phonetic_vowel(next)) sound = 'H';
+        break;
+      case 'K':
+        if (next == 'H') {
+          sound = 'X';
+          i++;
+        } else if (i > 0 || next != 'N') {
+          sound = 'K';
+        }
+        break;
+      case 'P':
+        if (next == 'H') {
+          sound = 'F';
+          i++;
+        } else {
+          sound = 'P';
+        }
+        break;
+      case 'Q':
+        sound = 'K';
+        break;
+      case 'S':
+        if (next == 'C' && s[i + 2] == 'H') {
+          sound = 'X';
+          i += 2;
+        } else if (next == 'H' || next == 'Z') {
+          sound = 'X';
+          i++;
+        } else {
+          sound = 'S';
+        }
+        break;
+      case 'T':
+        // "TCH" and "TSCH" sound as "CH"
+        if (next == 'C' && s[i + 2] == 'H') break;
+        if (next == 'S' && s[i + 2] == 'C' && s[i + 3] == 'H') break;
+        if (next == 'H') {
+          sound = '0';
+          i++;
+        } else {
+          sound = 'T';
+        }
+        break;
+      case 'V': case 'W':
+        sound = 'F';
+        break;
+      case 'X':
+        if (i == 0) {
+          sound = 'S';
+        } else {
+          code[size++] = 'K';
+          if (size < PHONETIC_MAX_LENGTH) sound = 'S';
+        }
+        break;
+      case 'Z':
+        if (next == 'H') {
+          sound = 'J';
+          i++;
+        } else {
+          sound = 'S';
+        }
+        break;
+      default:
+        sound = c;
+    }
+    // a sound spelt twice over, as in "CK", is kept once
+    if (sound != '\0' && (size == 0 || code[size - 1] != sound)) code[size++] = sound;
+  }
+  code[size] = '\0';
+  return size;
+}
+
+string_t *phonetic_key(const byte_t *last, size_t last_len, const byte_t *first, size_t first_len) {
+  char key[2 * PHONETIC_MAX_LENGTH + 2];
+  size_t len = phonetic_encode(last, last_len, key);
+  key[len++] = ',';
+  phonetic_encode(first, first_len, key + len);
+  string_t *s = string_from_alloc(key);
+  if (s == NULL) die("out of memory");
+  return s;
+}
+
+// the key an author ("First Middle Last") is filed under
+string_t *phonetic_author_key(const stack_t *author) {
+  const string_t *last = stack_peek(author);
+  const string_t *first = stack_size(author) > 1 ? author->values[0] : &EMPTY_STRING;
+  return phonetic_key(last->value, last->len, first->value, first->len);
+}
+
+/* The key a search for an author name looks up: "First Last" or "Last,
+   First" is looked up exactly, a single name as a prefix matching every
+   author with that last name. NULL if the query has no letters. */
+string_t *phonetic_query_key(const string_t *query, bool *prefix) {
+  const byte_t *v = query->value, *end = v + query->len;
+  const byte_t *comma = memchr(v, ',', query->len);
+  const byte_t *last, *last_end, *first = NULL, *first_end = NULL;
+  if (comma != NULL) {
+    last = v;
+    last_end = comma;
+    first = comma + 1;
+    while (first < end && *first == ' ') first++;
+    first_end = first;
+    while (first_end < end && *first_end != ' ') first_end++;
+  } else {
+    while (end > v && end[-1] == ' ') end--;
+    last_end = end;
+    last = last_end;
+    while (last > v && last[-1] != ' ') last--;
+    first = v;
+    while (first < last && *first == ' ') first++;
+    first_end = first;
+    while (first_end < last && *first_end != ' ') first_end++;
+  }
+  *prefix = first == first_end;
+  string_t *key = phonetic_key(last, last_end - last, first, first_end - first);
+  if (key->len == 1) {
+    string_free(key);
+    return NULL;
+  }
+  return key;
+}
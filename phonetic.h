@@ -0,0 +1,15 @@
+#ifndef PHONETIC_H_
+#define PHONETIC_H_
+#include <stdbool.h>
+#include "library.h"
+
+// codes are cut to this many sounds
+#define PHONETIC_MAX_LENGTH 8
+
+size_t phonetic_encode(const byte_t *name, size_t len, char code[PHONETIC_MAX_LENGTH + 1]);
+
+string_t *phonetic_author_key(const stack_t *author);
+
+string_t *phonetic_query_key(const string_t *query, bool *prefix);
+
+#endif // PHONETIC_H_
@@ -0,0 +1,131 @@
+#include <stdalign.h>
+#include "pool.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Index nodes and books come and go in the millions, so instead of a
+   malloc each they are cut from 64 KiB slabs owned by the catalogue.
+   Building costs a pointer bump per block and tearing down a catalogue
+   frees a handful of slabs. */
+
+struct SLAB_STRUCT {
+  struct SLAB_STRUCT *next;
+  alignas(max_align_t) byte_t bytes[];
+};
+
+slab_t *slab_alloc(slab_t **slabs, size_t size) {
+  slab_t *slab = malloc(sizeof(slab_t) + size);
+  if (slab == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(slab_t) + size);
+  slab->next = *slabs;
+  *slabs = slab;
+  return slab;
+}
+
+void slabs_free(slab_t *slab) {
+  while (slab != NULL) {
+    slab_t *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+}
+
+// blocks are pointer aligned, which is all nodes and packed books need
+size_t align_up(size_t size) {
+  return (size + alignof(void *) - 1) & ~(alignof(void *) - 1);
+}
+
+pool_t *pool_init(size_t size) {
+  pool_t *pool = calloc(1, sizeof(pool_t));
+  if (pool == NULL) die("out of memory");
+  // every block must be able to hold the free list link
+  pool->size = align_up(size < sizeof(void *) ? sizeof(void *) : size);
+  if (pool->size > POOL_SLAB_SIZE) die("pool_init(): block size too large");
+  return pool;
+}
+
+void *pool_alloc(pool_t *pool) {
+  pool->used++;
+  if (pool->free != NULL) {
+    void *block = pool->free;
+    pool->free = *(void **)block;
+    return block;
+  }
+  if (pool->next == NULL || pool->end - pool->next < (ptrdiff_t)pool->size) {
+    slab_t *slab = slab_alloc(&pool->slabs, POOL_SLAB_SIZE);
+    pool->next = slab->bytes;
+    pool->end = slab->bytes + POOL_SLAB_SIZE;
+  }
+  void *block = pool->next;
+  pool->next += pool->size;
+  return block;
+}
+
+void pool_release(pool_t *pool, void *block) {
+  if (block == NULL) return;
+  *(void **)block = pool->free;
+  pool->free = block;
+  pool->used--;
+}
+
+/* Takes over the slabs of a pool with the same block size, along with
+   its free blocks and what is left of its current slab, and frees it.
+   Blocks handed out by either pool stay valid. */
+void pool_merge(pool_t *pool, pool_t *other) {
+  if (other->size != pool->size) die("pool_merge(): block sizes differ");
+  while (other->next != NULL && other->end - other->next >= (ptrdiff_t)other->size) {
+    other->used++;
+    pool_release(other, other->next);
+    other->next += other->size;
+  }
+  while (other->free != NULL) {
+    void *block = other->free;
+    other->free = *(void **)block;
+    *(void **)block = pool->free;
+    pool->free = block;
+  }
+  if (other->slabs != NULL) {
+    slab_t *last = other->slabs;
+    while (last->next != NULL) last = last->next;
+    last->next = pool->slabs;
+    pool->slabs = other->slabs;
+  }
+  pool->used += other->used;
+  free(other);
+}
+
+void pool_free(pool_t *pool) {
+  if (pool == NULL) return;
+  slabs_free(pool->slabs);
+  free(pool);
+}
+
+arena_t *arena_init() {
+  arena_t *arena = calloc(1, sizeof(arena_t));
+  if (arena == NULL) die("out of memory");
+  return arena;
+}
+
+// blocks larger than a quarter slab get a slab of their own
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = align_up(size);
+  if (size > POOL_SLAB_SIZE / 4) {
+    slab_t *slab = slab_alloc(&arena->slabs, size);
+    return slab->bytes;
+  }
+  if (arena->next == NULL || arena->end - arena->next < (ptrdiff_t)size) {
+    slab_t *slab = slab_alloc(&arena->slabs, POOL_SLAB_SIZE);
+    arena->next = slab->bytes;
+    arena->end = slab->bytes + POOL_SLAB_SIZE;
+  }
+  void *block = arena->next;
+  arena->next += size;
+  return block;
+}
+
+void arena_free(arena_t *arena) {
+  if (arena == NULL) return;
+  slabs_free(arena->slabs);
+  free(arena);
+}
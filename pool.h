@@ -0,0 +1,46 @@
+#ifndef POOL_H_
+#define POOL_H_
+#include <stddef.h>
+#include "library.h"
+
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct SLAB_STRUCT slab_t;
+
+/*! Fixed-size blocks carved out of large slabs. Released blocks go on a
+  free list and are handed out again before the slabs grow; the slabs
+  themselves are only returned by pool_free. */
+struct POOL_STRUCT {
+  size_t size;
+  void *free;
+  slab_t *slabs;
+  byte_t *next;
+  byte_t *end;
+  size_t used;
+};
+
+/*! Blocks of any size, allocated one after the other from large slabs
+  and only ever freed all together. */
+struct ARENA_STRUCT {
+  slab_t *slabs;
+  byte_t *next;
+  byte_t *end;
+};
+
+pool_t *pool_init(size_t size);
+
+void *pool_alloc(pool_t *pool);
+
+void pool_release(pool_t *pool, void *block);
+
+void pool_merge(pool_t *pool, pool_t *other);
+
+void pool_free(pool_t *pool);
+
+arena_t *arena_init();
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+void arena_free(arena_t *arena);
+
+#endif // POOL_H_
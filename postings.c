@@ -0,0 +1,211 @@
+#include <string.h>
+#include "postings.h"
+#include "macros.h"
+#include "stats.h"
+
+/* Most index keys (titles, subtitles, full author names) belong to one
+   book, so posting lists start out held in the index entry itself. From
+   POSTINGS_INLINE + 1 books they move to an array growing in powers of
+   two, and from POSTINGS_PACK_MIN books, which only categories, years,
+   publishers and the like reach, they are stored as delta-encoded book
+   ids: ids grow with every book added, so the gaps in a big bucket are
+   small and most take one or two bytes instead of a pointer's eight. */
+
+booktable_t *booktable_init() {
+  booktable_t *t = calloc(1, sizeof(booktable_t));
+  if (t == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(booktable_t));
+  return t;
+}
+
+void booktable_free(booktable_t *t) {
+  if (t == NULL) return;
+  for (size_t i = 0; i < BOOKTABLE_CHUNKS && t->chunks[i] != NULL; i++)
+    free(t->chunks[i]);
+  free(t);
+}
+
+// gives bn the next id; only one thread may add at a time
+void booktable_add(booktable_t *t, booknode_t *bn) {
+  uint32_t size = atomic_load_explicit(&t->size, memory_order_relaxed);
+  if (size == (uint32_t)BOOKTABLE_CHUNK * BOOKTABLE_CHUNKS) die("booktable_add(): too many books");
+  booknode_t **chunk = t->chunks[size / BOOKTABLE_CHUNK];
+  if (chunk == NULL) {
+    chunk = malloc(BOOKTABLE_CHUNK * sizeof(booknode_t *));
+    if (chunk == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+    stats_count(STAT_ALLOC_BYTES, BOOKTABLE_CHUNK * sizeof(booknode_t *));
+    t->chunks[size / BOOKTABLE_CHUNK] = chunk;
+  }
+  chunk[size % BOOKTABLE_CHUNK] = bn;
+  bn->id = size;
+  // publishes the slot, and the chunk it is in, to readers of the size
+  atomic_store_explicit(&t->size, size + 1, memory_order_release);
+}
+
+booknode_t *booktable_get(const booktable_t *t, uint32_t id) {
+  if (id >= booktable_size(t)) die("booktable_get(): invalid book id");
+  return t->chunks[id / BOOKTABLE_CHUNK][id % BOOKTABLE_CHUNK];
+}
+
+uint32_t booktable_size(const booktable_t *t) {
+  return atomic_load_explicit(&t->size, memory_order_acquire);
+}
+
+void postings_init(postings_t *p) {
+  memset(p, 0, sizeof(postings_t));
+  p->kind = POSTINGS_SMALL;
+}
+
+size_t array_capacity(size_t size) {
+  size_t capacity = POSTINGS_ARRAY_MIN;
+  while (capacity < size) capacity *= 2;
+  return capacity;
+}
+
+booknode_t **array_alloc(size_t capacity) {
+  booknode_t **array = malloc(capacity * sizeof(booknode_t *));
+  if (array == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, capacity * sizeof(booknode_t *));
+  return array;
+}
+
+postings_block_t *block_alloc(const booktable_t *table, size_t capacity) {
+  postings_block_t *block = malloc(sizeof(postings_block_t) + capacity);
+  if (block == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, sizeof(postings_block_t) + capacity);
+  block->table = table;
+  block->len = 0;
+  block->capacity = capacity;
+  block->last = 0;
+  return block;
+}
+
+// count is the number of ids already in the block
+void block_append(postings_block_t **blockptr, size_t count, uint32_t id) {
+  postings_block_t *block = *blockptr;
+  if (count > 0 && id < block->last) die("postings_add(): books added out of order");
+  if (block->len + 5 > block->capacity) {
+    size_t capacity = block->capacity * 2;
+    block = realloc(block, sizeof(postings_block_t) + capacity);
+    if (block == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+    stats_count(STAT_ALLOC_BYTES, capacity - block->capacity);
+    block->capacity = capacity;
+    *blockptr = block;
+  }
+  uint32_t delta = id - block->last;
+  while (delta >= 0x80) {
+    block->bytes[block->len++] = (delta & 0x7f) | 0x80;
+    delta >>= 7;
+  }
+  block->bytes[block->len++] = delta;
+  block->last = id;
+}
+
+uint32_t block_read(const postings_block_t *block, uint32_t *offset) {
+  uint32_t delta = 0;
+  for (int shift = 0; ; shift += 7) {
+    byte_t b = block->bytes[(*offset)++];
+    delta |= (uint32_t)(b & 0x7f) << shift;
+    if (b < 0x80) return delta;
+  }
+}
+
+void postings_free(postings_t *p) {
+  if (p->kind == POSTINGS_ARRAY) free(p->array);
+  else if (p->kind == POSTINGS_PACKED) free(p->packed);
+  postings_init(p);
+}
+
+postings_t postings_copy(const postings_t *p) {
+  postings_t copy = *p;
+  if (p->kind == POSTINGS_ARRAY) {
+    copy.array = array_alloc(array_capacity(p->size));
+    memcpy(copy.array, p->array, p->size * sizeof(booknode_t *));
+  } else if (p->kind == POSTINGS_PACKED) {
+    copy.packed = block_alloc(p->packed->table, p->packed->capacity);
+    copy.packed->len = p->packed->len;
+    copy.packed->last = p->packed->last;
+    memcpy(copy.packed->bytes, p->packed->bytes, p->packed->len);
+  }
+  return copy;
+}
+
+// books must be added in ascending id order, as the catalogue adds them
+void postings_add(postings_t *p, booknode_t *bn, const booktable_t *table) {
+  if (p->kind == POSTINGS_SMALL) {
+    if (p->size < POSTINGS_INLINE) {
+      p->books[p->size++] = bn;
+      return;
+    }
+    booknode_t **array = array_alloc(array_capacity(p->size + 1));
+    memcpy(array, p->books, p->size * sizeof(booknode_t *));
+    p->array = array;
+    p->kind = POSTINGS_ARRAY;
+  }
+  if (p->kind == POSTINGS_ARRAY && p->size + 1 >= POSTINGS_PACK_MIN) {
+    postings_block_t *block = block_alloc(table, 2 * POSTINGS_PACK_MIN);
+    for (size_t i = 0; i < p->size; i++)
+      block_append(&block, i, p->array[i]->id);
+    free(p->array);
+    p->packed = block;
+    p->kind = POSTINGS_PACKED;
+  }
+  if (p->kind == POSTINGS_PACKED) {
+    block_append(&p->packed, p->size++, bn->id);
+    return;
+  }
+  if (p->size == array_capacity(p->size)) {
+    size_t capacity = array_capacity(p->size + 1);
+    booknode_t **array = realloc(p->array, capacity * sizeof(booknode_t *));
+    if (array == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+    stats_count(STAT_ALLOC_BYTES, (capacity - p->size) * sizeof(booknode_t *));
+    p->array = array;
+  }
+  p->array[p->size++] = bn;
+}
+
+// removes and returns the book added last
+booknode_t *postings_pop(postings_t *p) {
+  if (p->size == 0) return NULL;
+  if (p->kind == POSTINGS_SMALL) return p->books[--p->size];
+  if (p->kind == POSTINGS_ARRAY) return p->array[--p->size];
+  postings_block_t *block = p->packed;
+  uint32_t offset = 0, start = 0, id = 0, previous = 0;
+  for (size_t i = 0; i < p->size; i++) {
+    start = offset;
+    previous = id;
+    id += block_read(block, &offset);
+  }
+  block->len = start;
+  block->last = previous;
+  p->size--;
+  return booktable_get(block->table, id);
+}
+
+size_t postings_size(const postings_t *p) {
+  return p->size;
+}
+
+void postings_iter_init(postings_iter_t *it, const postings_t *p) {
+  it->postings = p;
+  it->index = 0;
+  it->offset = 0;
+  it->id = 0;
+}
+
+// the next book, or NULL past the last one
+booknode_t *postings_next(postings_iter_t *it) {
+  const postings_t *p = it->postings;
+  if (it->index >= p->size) return NULL;
+  if (p->kind == POSTINGS_SMALL) return p->books[it->index++];
+  if (p->kind == POSTINGS_ARRAY) return p->array[it->index++];
+  it->index++;
+  it->id += block_read(p->packed, &it->offset);
+  return booktable_get(p->packed->table, it->id);
+}
@@ -0,0 +1,66 @@
+#ifndef POSTINGS_H_
+#define POSTINGS_H_
+#include <stdint.h>
+#include <stdatomic.h>
+#include "library.h"
+
+// a bucket reaching this many books is delta-encoded
+#define POSTINGS_PACK_MIN 64
+#define POSTINGS_ARRAY_MIN 4
+
+#define BOOKTABLE_CHUNK 1024
+#define BOOKTABLE_CHUNKS 65536
+
+/*! Book ids are handed out in the order books are added. The table is
+  only ever appended to, by one writer at a time, and its size is
+  published only once the new slot is filled, so readers can look up
+  every id below the size they loaded while the writer adds more. */
+struct BOOKTABLE_STRUCT {
+  _Atomic uint32_t size;
+  booknode_t **chunks[BOOKTABLE_CHUNKS];
+};
+
+/*! Ascending book ids, each stored as the LEB128 varint of its
+  difference to the one before. */
+struct POSTINGS_BLOCK_STRUCT {
+  const booktable_t *table;
+  uint32_t len;
+  uint32_t capacity;
+  uint32_t last;
+  byte_t bytes[];
+};
+
+typedef struct {
+  const postings_t *postings;
+  uint32_t index;
+  uint32_t offset;
+  uint32_t id;
+} postings_iter_t;
+
+booktable_t *booktable_init();
+
+void booktable_free(booktable_t *t);
+
+void booktable_add(booktable_t *t, booknode_t *bn);
+
+booknode_t *booktable_get(const booktable_t *t, uint32_t id);
+
+uint32_t booktable_size(const booktable_t *t);
+
+void postings_init(postings_t *p);
+
+void postings_free(postings_t *p);
+
+postings_t postings_copy(const postings_t *p);
+
+void postings_add(postings_t *p, booknode_t *bn, const booktable_t *table);
+
+booknode_t *postings_pop(postings_t *p);
+
+size_t postings_size(const postings_t *p);
+
+void postings_iter_init(postings_iter_t *it, const postings_t *p);
+
+booknode_t *postings_next(postings_iter_t *it);
+
+#endif // POSTINGS_H_
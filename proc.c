@@ -0,0 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+#include "proc.h"
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+// writes to a socket whose peer has gone away fail with EPIPE instead
+void ignore_sigpipe() {
+  struct sigaction sa = { 0 };
+  sa.sa_handler = SIG_IGN;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPIPE, &sa, NULL);
+}
+
+/* Runs func(arg) in a forked child that sees a copy-on-write image of
+   this process and exits with its return value. Returns the child's pid,
+   or -1 if it could not be started. */
+int proc_spawn(int (*func)(void *), void *arg) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  // _exit so the child does not flush stdio buffers it shares with the parent
+  _exit(func(arg));
+}
+
+// returns -1 while the child is still running, otherwise its exit status
+int proc_wait(int pid, bool block) {
+  int status;
+  pid_t done;
+  do {
+    done = waitpid(pid, &status, block ? 0 : WNOHANG);
+  } while (done < 0 && errno == EINTR);
+  if (done == 0) return -1;
+  if (done < 0 || !WIFEXITED(status)) return 1;
+  return WEXITSTATUS(status);
+}
@@ -0,0 +1,15 @@
+#ifndef PROC_H_
+#define PROC_H_
+
+#include <stdbool.h>
+
+/* Process and signal helpers. Kept apart from library.h because the
+   system signal headers declare their own stack_t. */
+
+void ignore_sigpipe();
+
+int proc_spawn(int (*func)(void *), void *arg);
+
+int proc_wait(int pid, bool block);
+
+#endif // PROC_H_
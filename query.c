@@ -0,0 +1,324 @@
+#include <string.h>
+#include <unistd.h>
+#include "query.h"
+#include "macros.h"
+#include "stats.h"
+#include "cache.h"
+
+/* Non-interactive lookups for scripts:
+
+     library query [--json|--csv|--tsv] <file> [area:value]...
+     library export [--json|--csv|--tsv] <file>
+
+   The catalogue is only ever opened for reading. Each expression is a
+   search area from the search help (t, title, a, author, ...) and a value,
+   with a trailing '*' for a prefix search or '~' for a fuzzy one, which
+   finds the keys within a few edits of the value, closest first (a
+   backslash before either searches for it literally); an expression
+   without a known area searches titles. Without expressions they are
+   read from stdin, one per line. Every matching book is
+   printed as one line of tab separated values, one JSON object or one
+   RFC 4180 CSV record (after a header line), starting with the query it
+   matched. export writes the whole catalogue the same way, CSV by
+   default, without the query field. */
+
+typedef struct {
+  writer_t *w;
+  query_format_t format;
+  const string_t *query;
+  int matches;
+} query_state_t;
+
+void query_write_author_tsv(const stack_t *author, writer_t *w) {
+  for (size_t name = 0; name < stack_size(author); name++) {
+    if (name > 0) writer_append_char(w, ' ');
+    writer_append_tsv_field(w, author->values[name]);
+  }
+}
+
+void query_write_author_json(const stack_t *author, writer_t *w) {
+  writer_append_char(w, '"');
+  for (size_t name = 0; name < stack_size(author); name++) {
+    if (name > 0) writer_append_char(w, ' ');
+    writer_append_json_escaped(w, author->values[name]);
+  }
+  writer_append_char(w, '"');
+}
+
+// query is NULL for an export, whose lines have no query field
+void query_write_tsv(const book_t *book, const string_t *query, writer_t *w) {
+  if (query != NULL) {
+    writer_append_tsv_field(w, query);
+    writer_append_char(w, '\t');
+  }
+  writer_append_tsv_field(w, book->title);
+  writer_append_char(w, '\t');
+  writer_append_tsv_field(w, book->subtitle);
+  writer_append_char(w, '\t');
+  for (size_t auth = 0; auth < stack_size(book->authors); auth++) {
+    if (auth > 0) writer_append_char(w, ',');
+    query_write_author_tsv(book->authors->values[auth], w);
+  }
+  writer_append_char(w, '\t');
+  writer_append_tsv_field(w, book->publisher);
+  writer_append_char(w, '\t');
+  writer_append_tsv_field(w, book->location);
+  writer_append_char(w, '\t');
+  writer_append_int(w, book->year);
+  writer_append_char(w, '\t');
+  for (size_t cat = 0; cat < stack_size(book->categories); cat++) {
+    if (cat > 0) writer_append_char(w, ',');
+    writer_append_tsv_field(w, book->categories->values[cat]);
+  }
+  writer_append_char(w, '\n');
+}
+
+void query_write_json(const book_t *book, const string_t *query, writer_t *w) {
+  writer_append_char(w, '{');
+  if (query != NULL) {
+    writer_append_all(w, "\"query\":");
+    writer_append_json_string(w, query);
+    writer_append_char(w, ',');
+  }
+  writer_append_all(w, "\"title\":");
+  writer_append_json_string(w, book->title);
+  writer_append_all(w, ",\"subtitle\":");
+  writer_append_json_string(w, book->subtitle);
+  writer_append_all(w, ",\"authors\":[");
+  for (size_t auth = 0; auth < stack_size(book->authors); auth++) {
+    if (auth > 0) writer_append_char(w, ',');
+    query_write_author_json(book->authors->values[auth], w);
+  }
+  writer_append_all(w, "],\"publisher\":");
+  writer_append_json_string(w, book->publisher);
+  writer_append_all(w, ",\"location\":");
+  writer_append_json_string(w, book->location);
+  writer_append_all(w, ",\"year\":");
+  writer_append_int(w, book->year);
+  writer_append_all(w, ",\"categories\":[");
+  for (size_t cat = 0; cat < stack_size(book->categories); cat++) {
+    if (cat > 0) writer_append_char(w, ',');
+    writer_append_json_string(w, book->categories->values[cat]);
+  }
+  writer_append_all(w, "]}\n");
+}
+
+void query_write_author_csv(const stack_t *author, writer_t *w) {
+  for (size_t name = 0; name < stack_size(author); name++) {
+    if (name > 0) writer_append_char(w, ' ');
+    writer_append_csv_escaped(w, author->values[name]);
+  }
+}
+
+// authors and categories are comma separated lists, so always quoted
+void query_write_csv(const book_t *book, const string_t *query, writer_t *w) {
+  if (query != NULL) {
+    writer_append_csv_field(w, query);
+    writer_append_char(w, ',');
+  }
+  writer_append_csv_field(w, book->title);
+  writer_append_char(w, ',');
+  writer_append_csv_field(w, book->subtitle);
+  writer_append_all(w, ",\"");
+  for (size_t auth = 0; auth < stack_size(book->authors); auth++) {
+    if (auth > 0) writer_append_char(w, ',');
+    query_write_author_csv(book->authors->values[auth], w);
+  }
+  writer_append_all(w, "\",");
+  writer_append_csv_field(w, book->publisher);
+  writer_append_char(w, ',');
+  writer_append_csv_field(w, book->location);
+  writer_append_char(w, ',');
+  writer_append_int(w, book->year);
+  writer_append_all(w, ",\"");
+  for (size_t cat = 0; cat < stack_size(book->categories); cat++) {
+    if (cat > 0) writer_append_char(w, ',');
+    writer_append_csv_escaped(w, book->categories->values[cat]);
+  }
+  writer_append_all(w, "\"\r\n");
+}
+
+void query_write_book(const book_t *book, const string_t *query, writer_t *w, query_format_t format) {
+  if (format == QUERY_JSON)
+    query_write_json(book, query, w);
+  else if (format == QUERY_CSV)
+    query_write_csv(book, query, w);
+  else
+    query_write_tsv(book, query, w);
+}
+
+// the CSV header line; the other formats have none
+void query_write_header(writer_t *w, query_format_t format, bool query) {
+  if (format != QUERY_CSV) return;
+  if (query) writer_append_all(w, "query,");
+  writer_append_all(w, "title,subtitle,authors,publisher,location,year,categories\r\n");
+}
+
+int query_book(const booknode_t *bn, void *state) {
+  query_state_t *qs = state;
+  query_write_book(&bn->book, qs->query, qs->w, qs->format);
+  qs->matches++;
+  return 0;
+}
+
+// parses "area:value", or a bare value searching titles
+const search_area_t *query_parse_term(const string_t *term, string_t **value) {
+  const search_area_t *area = NULL;
+  *value = NULL;
+  const char *colon = strchr((char *)term->value, ':');
+  if (colon != NULL) {
+    string_t *name = string_copy_alloc(term);
+    name->len = colon - (char *)term->value;
+    name->value[name->len] = '\0';
+    area = search_area_find((char *)name->value);
+    string_free(name);
+    if (area != NULL) *value = string_from_alloc(colon + 1);
+  }
+  if (area == NULL) {
+    area = search_area_find("title");
+    *value = string_copy_alloc(term);
+  }
+  return area;
+}
+
+// the index an expression searches, to be built before it is run
+uint32_t query_indexes(const string_t *expr) {
+  if (string_length(expr) == 0) return 0;
+  string_t *value;
+  const search_area_t *area = query_parse_term(expr, &value);
+  string_free(value);
+  return search_area_bit(area);
+}
+
+// returns the number of books written
+int query_run(const catalogue_t *c, const string_t *expr, writer_t *w, query_format_t format) {
+  if (string_length(expr) == 0) return 0;
+  uint64_t start = stats_now();
+  query_state_t qs = { w, format, expr, 0 };
+  string_t *value;
+  const search_area_t *area = query_parse_term(expr, &value);
+  if (value != NULL)
+    catalogue_find(c, area, value, NULL, query_book, &qs);
+  string_free(value);
+  stats_record_since("query", start);
+  return qs.matches;
+}
+
+void query_usage(const char *program) {
+  fprintf(stderr, "Usage: %s query [--json|--csv|--tsv] [--eager areas] <file> [area:value]...\n", program);
+}
+
+bool query_parse_format(const char *arg, query_format_t *format) {
+  if (strcmp(arg, "--json") == 0) *format = QUERY_JSON;
+  else if (strcmp(arg, "--csv") == 0) *format = QUERY_CSV;
+  else if (strcmp(arg, "--tsv") == 0) *format = QUERY_TSV;
+  else return false;
+  return true;
+}
+
+int query_main(int argc, char **argv) {
+  query_format_t format = QUERY_TSV;
+  uint32_t eager;
+  catalogue_parse_indexes(CATALOGUE_EAGER_INDEXES, &eager);
+  int arg = 2;
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-'; arg++) {
+    if (query_parse_format(argv[arg], &format)) continue;
+    if (strcmp(argv[arg], "--eager") == 0 && arg + 1 < argc &&
+             catalogue_parse_indexes(argv[arg + 1], &eager)) arg++;
+    else {
+      query_usage(argv[0]);
+      return 1;
+    }
+  }
+  // a catalogue read from stdin leaves only the arguments for queries
+  if (arg == argc || (arg + 1 == argc && strcmp(argv[arg], "-") == 0)) {
+    query_usage(argv[0]);
+    return 1;
+  }
+
+  catalogue_t *c = catalogue_init();
+  catalogue_build_indexes(c, eager);
+  // queries given as arguments run once and stream their books, so only
+  // those read from stdin, which may repeat, are cached
+  if (arg + 1 == argc) c->cache = query_cache_init(QUERY_CACHE_CAPACITY);
+  string_t *filename = string_from_alloc(argv[arg++]);
+  int err = catalogue_read_from_file(c, filename);
+  string_free(filename);
+  if (err) {
+    catalogue_free(c);
+    return 1;
+  }
+
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  query_write_header(w, format, true);
+  if (arg < argc) {
+    for (; arg < argc; arg++) {
+      string_t *expr = string_from_alloc(argv[arg]);
+      catalogue_build_indexes(c, query_indexes(expr));
+      query_run(c, expr, w, format);
+      string_free(expr);
+    }
+  } else {
+    // answer each line as it comes when driven interactively
+    bool interactive = isatty(STDIN_FILENO);
+    while (true) {
+      string_t *expr = file_read_line_alloc(stdin);
+      if (string_length(expr) == 0) {
+        string_free(expr);
+        break;
+      }
+      if (expr->value[expr->len - 1] == '\n') trunc_string(expr);
+      catalogue_build_indexes(c, query_indexes(expr));
+      query_run(c, expr, w, format);
+      string_free(expr);
+      if (interactive) writer_flush(w);
+    }
+  }
+  err = writer_free(w);
+  catalogue_free(c);
+  return err;
+}
+
+void export_usage(const char *program) {
+  fprintf(stderr, "Usage: %s export [--json|--csv|--tsv] <file>\n", program);
+}
+
+/* Writes every book in the catalogue, in the order they were added,
+   without building any index. Books go straight from the book store
+   into the writer's buffer, which is handed to stdout whenever it
+   fills, so the export takes no memory beyond the loaded catalogue. */
+int export_main(int argc, char **argv) {
+  query_format_t format = QUERY_CSV;
+  int arg = 2;
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-'; arg++) {
+    if (!query_parse_format(argv[arg], &format)) {
+      export_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (arg + 1 != argc) {
+    export_usage(argv[0]);
+    return 1;
+  }
+
+  catalogue_t *c = catalogue_init();
+  string_t *filename = string_from_alloc(argv[arg]);
+  int err = catalogue_read_from_file(c, filename);
+  string_free(filename);
+  if (err) {
+    catalogue_free(c);
+    return 1;
+  }
+
+  uint64_t start = stats_now();
+  writer_t *w = writer_init(stdout, WRITER_DEFAULT_CAPACITY);
+  query_write_header(w, format, false);
+  for (uint32_t id = 0; id < c->size; id++) {
+    const booknode_t *bn = catalogue_book(c, id);
+    if (!bn->book.removed) query_write_book(&bn->book, NULL, w, format);
+  }
+  err = writer_free(w);
+  stats_record_since("export", start);
+  catalogue_free(c);
+  return err;
+}
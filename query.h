@@ -0,0 +1,22 @@
+#ifndef QUERY_H_
+#define QUERY_H_
+#include "library.h"
+#include "writer.h"
+
+typedef enum {
+  QUERY_TSV,
+  QUERY_JSON,
+  QUERY_CSV
+} query_format_t;
+
+void query_write_book(const book_t *book, const string_t *query, writer_t *w, query_format_t format);
+
+uint32_t query_indexes(const string_t *expr);
+
+int query_run(const catalogue_t *c, const string_t *expr, writer_t *w, query_format_t format);
+
+int query_main(int argc, char **argv);
+
+int export_main(int argc, char **argv);
+
+#endif // QUERY_H_
@@ -0,0 +1,76 @@
+#include "reader.h"
+#include "macros.h"
+#include "stats.h"
+#include <string.h>
+
+reader_t *reader_init(FILE *f, size_t capacity) {
+  if (f == NULL) die("reader_init(): file was null");
+  if (capacity == 0) capacity = READER_DEFAULT_CAPACITY;
+  reader_t *r = malloc(sizeof(reader_t));
+  if (r == NULL) die("out of memory");
+  // one spare byte for the NUL after a last line without a newline
+  r->buffer = malloc(capacity + 1);
+  if (r->buffer == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 2);
+  stats_count(STAT_ALLOC_BYTES, sizeof(reader_t) + capacity + 1);
+  r->file = f;
+  r->start = 0;
+  r->scanned = 0;
+  r->len = 0;
+  r->capacity = capacity;
+  r->eof = false;
+  r->error = false;
+  return r;
+}
+
+// moves the unread bytes to the front and reads a block behind them
+void reader_fill(reader_t *r) {
+  if (r->start > 0) {
+    memmove(r->buffer, r->buffer + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->scanned -= r->start;
+    r->start = 0;
+  }
+  if (r->len == r->capacity) {
+    size_t capacity = 2 * r->capacity;
+    byte_t *buffer = realloc(r->buffer, capacity + 1);
+    if (buffer == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+    stats_count(STAT_ALLOC_BYTES, capacity - r->capacity);
+    r->buffer = buffer;
+    r->capacity = capacity;
+  }
+  size_t n = fread(r->buffer + r->len, 1, r->capacity - r->len, r->file);
+  if (n == 0) {
+    r->eof = true;
+    if (ferror(r->file)) r->error = true;
+  }
+  r->len += n;
+}
+
+/* The next line without its newline, NUL-terminated in place, or NULL
+   at the end of the stream. It stays valid until the next call. */
+byte_t *reader_next_line(reader_t *r, size_t *len) {
+  while (true) {
+    byte_t *newline = memchr(r->buffer + r->scanned, '\n', r->len - r->scanned);
+    if (newline != NULL || (r->eof && r->start < r->len)) {
+      byte_t *line = r->buffer + r->start;
+      byte_t *end = newline != NULL ? newline : r->buffer + r->len;
+      *end = '\0';
+      *len = end - line;
+      r->start = r->scanned = newline != NULL ? end + 1 - r->buffer : r->len;
+      return line;
+    }
+    if (r->eof) return NULL;
+    r->scanned = r->len;
+    reader_fill(r);
+  }
+}
+
+int reader_free(reader_t *r) {
+  if (r == NULL) return 0;
+  int err = r->error;
+  free(r->buffer);
+  free(r);
+  return err;
+}
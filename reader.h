@@ -0,0 +1,29 @@
+#ifndef READER_H_
+#define READER_H_
+#include "better_string.h"
+
+#define READER_DEFAULT_CAPACITY (1 << 16)
+
+/*! Buffered input for streams that cannot be sized up front, such as
+  pipes: whole blocks are read into one buffer, lines are handed out in
+  place, and the unread tail is moved to the front before the next
+  block is read behind it. The buffer only grows for a line longer than
+  itself. */
+typedef struct {
+  FILE *file;
+  byte_t *buffer;
+  size_t start;
+  size_t scanned;
+  size_t len;
+  size_t capacity;
+  bool eof;
+  bool error;
+} reader_t;
+
+reader_t *reader_init(FILE *f, size_t capacity);
+
+byte_t *reader_next_line(reader_t *r, size_t *len);
+
+int reader_free(reader_t *r);
+
+#endif // READER_H_
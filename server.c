@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "library.h"
+#include "tree.h"
+#include "query.h"
+#include "macros.h"
+#include "stats.h"
+#include "proc.h"
+#include "shared.h"
+
+/* Resident catalogue server:
+
+     library serve [--threads N] [--eager areas] <file> <socket>
+
+   Loads the catalogue once and answers clients on a Unix domain socket.
+   Each request is one line, answered by zero or more tab separated data
+   lines (the first column repeats the request argument) and a status
+   line, "OK <count>" or "ERR <message>":
+
+     SEARCH <area:value>   books matching a query expression, as in
+                           'library query'
+     LIST <area> [options] the keys in a search area; "limit N",
+                           "offset M" and "desc" list part of them
+     ADD <record>          add a book given in the catalogue file format
+     PING                  check the server is alive
+     QUIT                  close the connection
+
+   Accepted connections are queued for a fixed pool of worker threads.
+   Lookups read the published catalogue version without locking while
+   ADD builds and publishes the next one (see shared.h) and appends the
+   book to the catalogue file. An index nothing has needed yet is built
+   and published the same way by the first request that needs it. */
+
+typedef struct {
+  shared_catalogue_t *catalogue;
+  writer_t *file;
+  // each worker parses added books with its own parser
+  view_parser_t *parsers[SHARED_MAX_READERS];
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  int queue[SERVER_QUEUE_CAPACITY];
+  size_t head;
+  size_t count;
+} server_t;
+
+typedef struct {
+  writer_t *w;
+  const search_area_t *area;
+  int count;
+} list_state_t;
+
+void server_push(server_t *s, int fd) {
+  pthread_mutex_lock(&s->queue_lock);
+  if (s->count == SERVER_QUEUE_CAPACITY) {
+    pthread_mutex_unlock(&s->queue_lock);
+    close(fd);
+    return;
+  }
+  s->queue[(s->head + s->count) % SERVER_QUEUE_CAPACITY] = fd;
+  s->count++;
+  pthread_cond_signal(&s->queue_cond);
+  pthread_mutex_unlock(&s->queue_lock);
+}
+
+int server_pop(server_t *s) {
+  pthread_mutex_lock(&s->queue_lock);
+  while (s->count == 0)
+    pthread_cond_wait(&s->queue_cond, &s->queue_lock);
+  int fd = s->queue[s->head];
+  s->head = (s->head + 1) % SERVER_QUEUE_CAPACITY;
+  s->count--;
+  pthread_mutex_unlock(&s->queue_lock);
+  return fd;
+}
+
+int server_list_walk(const key_t *k, const postings_t *books, void *state) {
+  list_state_t *ls = state;
+  if (!book_exists(books)) return 0;
+  writer_append_all(ls->w, ls->area->name);
+  writer_append_char(ls->w, '\t');
+  key_write(k, ls->w);
+  writer_append_char(ls->w, '\n');
+  ls->count++;
+  return 0;
+}
+
+void server_reply(writer_t *w, const char *status, long count) {
+  writer_append_all(w, status);
+  if (count >= 0) {
+    writer_append_char(w, ' ');
+    writer_append_int(w, count);
+  }
+  writer_append_char(w, '\n');
+}
+
+// publishes a catalogue version with these indexes unless the current one has them
+void server_build_indexes(server_t *s, size_t reader, uint32_t indexes) {
+  const catalogue_t *c = shared_read_begin(s->catalogue, reader);
+  bool built = (c->indexes & indexes) == indexes;
+  shared_read_end(s->catalogue, reader);
+  if (built) return;
+  catalogue_build_indexes(shared_write_begin(s->catalogue), indexes);
+  shared_write_end(s->catalogue);
+}
+
+void server_search(server_t *s, size_t reader, const char *arg, writer_t *w) {
+  string_t *expr = string_from_alloc(arg);
+  server_build_indexes(s, reader, query_indexes(expr));
+  const catalogue_t *c = shared_read_begin(s->catalogue, reader);
+  int matches = query_run(c, expr, w, QUERY_TSV);
+  shared_read_end(s->catalogue, reader);
+  string_free(expr);
+  server_reply(w, "OK", matches);
+}
+
+void server_list(server_t *s, size_t reader, const char *arg, writer_t *w) {
+  char name[16];
+  listing_t listing;
+  size_t len = strcspn(arg, " ");
+  if (len >= sizeof(name) || !listing_parse(arg + len, &listing)) {
+    server_reply(w, "ERR invalid listing", -1);
+    return;
+  }
+  memcpy(name, arg, len);
+  name[len] = '\0';
+  list_state_t ls = { w, search_area_find(name), 0 };
+  if (ls.area == NULL) {
+    server_reply(w, "ERR unknown search area", -1);
+    return;
+  }
+  server_build_indexes(s, reader, search_area_bit(ls.area));
+  const catalogue_t *c = shared_read_begin(s->catalogue, reader);
+  avl_walk_range(catalogue_area_index(c, ls.area), listing.offset, listing.limit,
+                 listing.order == LIST_DESCENDING, server_list_walk, &ls);
+  shared_read_end(s->catalogue, reader);
+  server_reply(w, "OK", ls.count);
+}
+
+// parses the record in place, so arg is overwritten
+void server_add(server_t *s, size_t reader, char *arg, writer_t *w) {
+  const book_t *view = book_parse_view(s->parsers[reader], (byte_t *)arg, strlen(arg));
+  if (view == NULL) {
+    server_reply(w, "ERR invalid book", -1);
+    return;
+  }
+  book_t book = book_copy_alloc(view);
+  catalogue_t *c = shared_write_begin(s->catalogue);
+  if (catalogue_contains_book(c, &book)) {
+    shared_write_end(s->catalogue);
+    book_free(book);
+    server_reply(w, "ERR duplicate book", -1);
+    return;
+  }
+  write_book_to_file(&book, s->file);
+  int err = writer_flush(s->file);
+  catalogue_add_book(c, book);
+  shared_write_end(s->catalogue);
+  server_reply(w, err ? "ERR could not write catalogue file" : "OK", err ? -1 : 1);
+}
+
+// returns true once the client asked to close the connection
+bool server_request(server_t *s, size_t reader, char *line, writer_t *w) {
+  char *arg = strchr(line, ' ');
+  size_t len = arg == NULL ? strlen(line) : (size_t)(arg - line);
+  arg = arg == NULL ? line + len : arg + 1;
+  uint64_t start = stats_now();
+  if (len == 6 && strncmp(line, "SEARCH", len) == 0) {
+    server_search(s, reader, arg, w);
+    stats_record_since("server search", start);
+  } else if (len == 4 && strncmp(line, "LIST", len) == 0) {
+    server_list(s, reader, arg, w);
+    stats_record_since("server list", start);
+  } else if (len == 3 && strncmp(line, "ADD", len) == 0) {
+    server_add(s, reader, arg, w);
+    stats_record_since("server add", start);
+  } else if (len == 4 && strncmp(line, "PING", len) == 0) {
+    server_reply(w, "OK", -1);
+  } else if (len == 4 && strncmp(line, "QUIT", len) == 0) {
+    server_reply(w, "OK", -1);
+    return true;
+  } else {
+    server_reply(w, "ERR unknown command", -1);
+  }
+  return false;
+}
+
+void server_serve_client(server_t *s, size_t reader, int fd) {
+  int outfd = dup(fd);
+  FILE *in = fdopen(fd, "r");
+  FILE *out = outfd < 0 ? NULL : fdopen(outfd, "w");
+  if (in == NULL || out == NULL) {
+    if (in != NULL) fclose(in);
+    else close(fd);
+    if (out != NULL) fclose(out);
+    else if (outfd >= 0) close(outfd);
+    return;
+  }
+  writer_t *w = writer_init(out, WRITER_DEFAULT_CAPACITY);
+  bool done = false;
+  while (!done) {
+    string_t *line = file_read_line_alloc(in);
+    if (string_length(line) == 0) {
+      string_free(line);
+      break;
+    }
+    if (line->value[line->len - 1] == '\n') trunc_string(line);
+    if (line->len > 0 && line->value[line->len - 1] == '\r') trunc_string(line);
+    if (line->len > 0)
+      done = server_request(s, reader, (char *)line->value, w);
+    string_free(line);
+    if (writer_flush(w)) break;
+  }
+  writer_free(w);
+  fclose(out);
+  fclose(in);
+}
+
+void *server_worker(void *arg) {
+  server_t *s = arg;
+  size_t reader = shared_register_reader(s->catalogue);
+  s->parsers[reader] = view_parser_init();
+  while (true)
+    server_serve_client(s, reader, server_pop(s));
+  return NULL;
+}
+
+int server_listen(const char *path) {
+  struct sockaddr_un addr = { 0 };
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void server_usage(const char *program) {
+  fprintf(stderr, "Usage: %s serve [--threads N] [--eager areas] <file> <socket>\n", program);
+}
+
+int server_main(int argc, char **argv) {
+  int threads = SERVER_DEFAULT_THREADS;
+  uint32_t eager;
+  catalogue_parse_indexes(CATALOGUE_EAGER_INDEXES, &eager);
+  bool valid = true;
+  int arg = 2;
+  for (; valid && arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0; arg += 2) {
+    if (strcmp(argv[arg], "--threads") == 0) threads = atoi(argv[arg + 1]);
+    else if (strcmp(argv[arg], "--eager") == 0) valid = catalogue_parse_indexes(argv[arg + 1], &eager);
+    else valid = false;
+  }
+  // added books are appended to the catalogue, so it cannot come from stdin
+  if (!valid || argc - arg != 2 || threads < 1 || threads > SHARED_MAX_READERS || strcmp(argv[arg], "-") == 0) {
+    server_usage(argv[0]);
+    return 1;
+  }
+  const char *path = argv[arg];
+  const char *socket_path = argv[arg + 1];
+
+  server_t *s = calloc(1, sizeof(server_t));
+  if (s == NULL) die("out of memory");
+  catalogue_t *c = catalogue_init();
+  catalogue_build_indexes(c, eager);
+  string_t *filename = string_from_alloc(path);
+  int err = catalogue_read_from_file(c, filename);
+  string_free(filename);
+  if (err) return 1;
+  s->catalogue = shared_init(c);
+  FILE *f = fopen(path, "a");
+  if (f == NULL) {
+    fprintf(stderr, "could not open %s for writing\n", path);
+    return 1;
+  }
+  s->file = writer_init(f, WRITER_DEFAULT_CAPACITY);
+  pthread_mutex_init(&s->queue_lock, NULL);
+  pthread_cond_init(&s->queue_cond, NULL);
+
+  int listener = server_listen(socket_path);
+  if (listener < 0) return 1;
+  ignore_sigpipe();
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_worker, s) != 0) die("could not start worker thread");
+    pthread_detach(thread);
+  }
+  fprintf(stderr, "Serving %s on %s with %d threads\n", path, socket_path, threads);
+
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    server_push(s, fd);
+  }
+  close(listener);
+  unlink(socket_path);
+  return 1;
+}
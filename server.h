@@ -0,0 +1,9 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#define SERVER_DEFAULT_THREADS 4
+#define SERVER_QUEUE_CAPACITY 256
+
+int server_main(int argc, char **argv);
+
+#endif // SERVER_H_
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+#include "shared.h"
+#include "macros.h"
+
+typedef struct {
+  uint64_t epoch;
+  catalogue_t *version;
+} retired_t;
+
+shared_catalogue_t *shared_init(catalogue_t *c) {
+  if (c == NULL) die("shared_init(): catalogue was null");
+  shared_catalogue_t *s = calloc(1, sizeof(shared_catalogue_t));
+  if (s == NULL) die("out of memory");
+  atomic_init(&s->current, c);
+  atomic_init(&s->epoch, 1);
+  atomic_init(&s->nreaders, 0);
+  for (size_t i = 0; i < SHARED_MAX_READERS; i++)
+    atomic_init(&s->readers[i], 0);
+  pthread_mutex_init(&s->writer, NULL);
+  s->limbo = stack_init(0);
+  return s;
+}
+
+void shared_collect_locked(shared_catalogue_t *s);
+
+void retired_free(retired_t *r) {
+  catalogue_snapshot_free(r->version);
+  free(r);
+}
+
+// only once no reader threads are running
+void shared_free(shared_catalogue_t *s) {
+  if (s == NULL) return;
+  stack_free(s->limbo, (freefunc_t)retired_free);
+  catalogue_free(atomic_load(&s->current));
+  pthread_mutex_destroy(&s->writer);
+  free(s);
+}
+
+size_t shared_register_reader(shared_catalogue_t *s) {
+  size_t reader = atomic_fetch_add(&s->nreaders, 1);
+  if (reader >= SHARED_MAX_READERS) die("shared_register_reader(): too many readers");
+  return reader;
+}
+
+/* The epoch is announced before the version pointer is loaded, so a
+   writer that retires a version after publishing its successor will see
+   this reader's epoch whenever the reader could have loaded the old one. */
+const catalogue_t *shared_read_begin(shared_catalogue_t *s, size_t reader) {
+  atomic_store(&s->readers[reader], atomic_load(&s->epoch));
+  return atomic_load(&s->current);
+}
+
+void shared_read_end(shared_catalogue_t *s, size_t reader) {
+  atomic_store(&s->readers[reader], 0);
+}
+
+catalogue_t *shared_write_begin(shared_catalogue_t *s) {
+  pthread_mutex_lock(&s->writer);
+  s->next = catalogue_snapshot(atomic_load(&s->current));
+  return s->next;
+}
+
+void shared_write_end(shared_catalogue_t *s) {
+  catalogue_t *next = take(&s->next);
+  if (next == NULL) die("shared_write_end(): no write in progress");
+  retired_t *r = malloc(sizeof(retired_t));
+  if (r == NULL) die("out of memory");
+  r->version = atomic_exchange(&s->current, next);
+  r->epoch = atomic_fetch_add(&s->epoch, 1);
+  stack_push(s->limbo, r);
+  shared_collect_locked(s);
+  pthread_mutex_unlock(&s->writer);
+}
+
+void shared_collect_locked(shared_catalogue_t *s) {
+  uint64_t oldest = UINT64_MAX;
+  size_t nreaders = min(atomic_load(&s->nreaders), SHARED_MAX_READERS);
+  for (size_t i = 0; i < nreaders; i++) {
+    uint64_t epoch = atomic_load(&s->readers[i]);
+    if (epoch != 0 && epoch < oldest) oldest = epoch;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < stack_size(s->limbo); i++) {
+    retired_t *r = s->limbo->values[i];
+    if (r->epoch < oldest)
+      retired_free(r);
+    else
+      s->limbo->values[kept++] = r;
+  }
+  s->limbo->size = kept;
+}
+
+void shared_collect(shared_catalogue_t *s) {
+  pthread_mutex_lock(&s->writer);
+  shared_collect_locked(s);
+  pthread_mutex_unlock(&s->writer);
+}
+
+/* Reference counts are only changed under the writer lock, so snapshots
+   that outlive a read are taken and freed here. */
+catalogue_t *shared_snapshot(shared_catalogue_t *s) {
+  pthread_mutex_lock(&s->writer);
+  catalogue_t *snapshot = catalogue_snapshot(atomic_load(&s->current));
+  pthread_mutex_unlock(&s->writer);
+  return snapshot;
+}
+
+void shared_snapshot_free(shared_catalogue_t *s, catalogue_t *snapshot) {
+  pthread_mutex_lock(&s->writer);
+  catalogue_snapshot_free(snapshot);
+  pthread_mutex_unlock(&s->writer);
+}
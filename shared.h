@@ -0,0 +1,50 @@
+#ifndef SHARED_H_
+#define SHARED_H_
+#include <stdatomic.h>
+#include <pthread.h>
+#include "library.h"
+
+#define SHARED_MAX_READERS 64
+
+/*! A catalogue shared between reader threads and one writer at a time.
+
+  Readers never block: they announce the current epoch in their slot and
+  read whichever catalogue version is published. The writer builds the
+  next version from a snapshot of the current one, so only the index
+  paths it changes are copied, publishes it with one atomic store and
+  retires the version it replaced. A retired version is released once
+  every active reader announced a later epoch. Versions share the book
+  id table and the duplicate set, which only the writer changes: a
+  version reads ids below its own size only, and the duplicate set is
+  only searched under the writer lock. */
+typedef struct {
+  _Atomic(catalogue_t *) current;
+  _Atomic uint64_t epoch;
+  _Atomic uint64_t readers[SHARED_MAX_READERS];
+  _Atomic size_t nreaders;
+  pthread_mutex_t writer;
+  catalogue_t *next;
+  stack_t *limbo;
+} shared_catalogue_t;
+
+shared_catalogue_t *shared_init(catalogue_t *c);
+
+void shared_free(shared_catalogue_t *s);
+
+size_t shared_register_reader(shared_catalogue_t *s);
+
+const catalogue_t *shared_read_begin(shared_catalogue_t *s, size_t reader);
+
+void shared_read_end(shared_catalogue_t *s, size_t reader);
+
+catalogue_t *shared_write_begin(shared_catalogue_t *s);
+
+void shared_write_end(shared_catalogue_t *s);
+
+void shared_collect(shared_catalogue_t *s);
+
+catalogue_t *shared_snapshot(shared_catalogue_t *s);
+
+void shared_snapshot_free(shared_catalogue_t *s, catalogue_t *snapshot);
+
+#endif // SHARED_H_
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include "macros.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+static const char *COUNTER_NAMES[STAT_COUNTERS] = {
+  [STAT_ALLOCS] = "allocations",
+  [STAT_ALLOC_BYTES] = "allocated_bytes",
+  [STAT_BYTES_PARSED] = "bytes_parsed",
+  [STAT_BOOKS_PARSED] = "books_parsed",
+  [STAT_PERSIST_RECORDS] = "persisted_records",
+  [STAT_PERSIST_BATCHES] = "persist_batches",
+  [STAT_PERSIST_FSYNCS] = "fsyncs",
+  [STAT_CACHE_HITS] = "cache_hits",
+  [STAT_CACHE_MISSES] = "cache_misses"
+};
+
+static _Atomic uint64_t counters[STAT_COUNTERS];
+static histogram_t *histograms[STATS_MAX_HISTOGRAMS];
+static size_t nhistograms = 0;
+// guards the histograms, recorded from server worker threads too
+static pthread_mutex_t histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+size_t histogram_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_COUNT) return value;
+  int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) + (value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// largest value that lands in the same bucket
+uint64_t histogram_bucket_value(size_t index) {
+  if (index < HISTOGRAM_SUB_COUNT) return index;
+  int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t sub = (index & (HISTOGRAM_SUB_COUNT - 1)) + HISTOGRAM_SUB_COUNT;
+  return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *h, uint64_t value) {
+  if (h == NULL) die("histogram_record(): histogram was null");
+  if (h->count == 0 || value < h->min) h->min = value;
+  if (value > h->max) h->max = value;
+  h->count++;
+  h->total += value;
+  h->buckets[histogram_index(value)]++;
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+  if (h == NULL || h->count == 0) return 0;
+  uint64_t target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+  if (target == 0) target = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= target) return min(histogram_bucket_value(i), h->max);
+  }
+  return h->max;
+}
+
+histogram_t *stats_histogram(const char *name) {
+  for (size_t i = 0; i < nhistograms; i++)
+    if (strcmp(histograms[i]->name, name) == 0) return histograms[i];
+  if (nhistograms == STATS_MAX_HISTOGRAMS) return NULL;
+  histogram_t *h = calloc(1, sizeof(histogram_t));
+  if (h == NULL) die("out of memory");
+  h->name = name;
+  histograms[nhistograms++] = h;
+  return h;
+}
+
+void stats_record(const char *name, uint64_t nanoseconds) {
+  pthread_mutex_lock(&histograms_lock);
+  histogram_t *h = stats_histogram(name);
+  if (h != NULL) histogram_record(h, nanoseconds);
+  pthread_mutex_unlock(&histograms_lock);
+}
+
+void stats_record_since(const char *name, uint64_t start) {
+  stats_record(name, stats_now() - start);
+}
+
+void stats_count(stat_counter_t counter, uint64_t n) {
+  atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+uint64_t stats_counter(stat_counter_t counter) {
+  return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+void write_duration(writer_t *w, uint64_t ns) {
+  char buf[32];
+  if (ns < 1000)
+    snprintf(buf, sizeof(buf), "%10lluns", (unsigned long long)ns);
+  else if (ns < 1000000)
+    snprintf(buf, sizeof(buf), "%10.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, sizeof(buf), "%10.1fms", ns / 1e6);
+  else
+    snprintf(buf, sizeof(buf), "%10.2fs ", ns / 1e9);
+  writer_append_all(w, buf);
+}
+
+void stats_print(writer_t *w) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%-16s %8s %12s %12s %12s\n", "", "count", "p50", "p99", "max");
+  writer_append_all(w, buf);
+  pthread_mutex_lock(&histograms_lock);
+  for (size_t i = 0; i < nhistograms; i++) {
+    histogram_t *h = histograms[i];
+    snprintf(buf, sizeof(buf), "%-16s %8llu ", h->name, (unsigned long long)h->count);
+    writer_append_all(w, buf);
+    write_duration(w, histogram_percentile(h, 50));
+    writer_append_char(w, ' ');
+    write_duration(w, histogram_percentile(h, 99));
+    writer_append_char(w, ' ');
+    write_duration(w, h->max);
+    writer_append_char(w, '\n');
+  }
+  pthread_mutex_unlock(&histograms_lock);
+  writer_append_char(w, '\n');
+  for (size_t i = 0; i < STAT_COUNTERS; i++) {
+    snprintf(buf, sizeof(buf), "%-16s %llu\n", COUNTER_NAMES[i],
+             (unsigned long long)stats_counter(i));
+    writer_append_all(w, buf);
+  }
+  uint64_t lookups = stats_counter(STAT_CACHE_HITS) + stats_counter(STAT_CACHE_MISSES);
+  if (lookups > 0) {
+    snprintf(buf, sizeof(buf), "%-16s %.1f%%\n", "cache_hit_rate",
+             100.0 * stats_counter(STAT_CACHE_HITS) / lookups);
+    writer_append_all(w, buf);
+  }
+}
+
+void stats_write_json(writer_t *w) {
+  writer_append_all(w, "{\"histograms\":{");
+  pthread_mutex_lock(&histograms_lock);
+  for (size_t i = 0; i < nhistograms; i++) {
+    histogram_t *h = histograms[i];
+    if (i > 0) writer_append_char(w, ',');
+    writer_append_char(w, '"');
+    writer_append_all(w, h->name);
+    writer_append_all(w, "\":{\"count\":");
+    writer_append_int(w, h->count);
+    writer_append_all(w, ",\"total_ns\":");
+    writer_append_int(w, h->total);
+    writer_append_all(w, ",\"min_ns\":");
+    writer_append_int(w, h->min);
+    writer_append_all(w, ",\"p50_ns\":");
+    writer_append_int(w, histogram_percentile(h, 50));
+    writer_append_all(w, ",\"p90_ns\":");
+    writer_append_int(w, histogram_percentile(h, 90));
+    writer_append_all(w, ",\"p99_ns\":");
+    writer_append_int(w, histogram_percentile(h, 99));
+    writer_append_all(w, ",\"p999_ns\":");
+    writer_append_int(w, histogram_percentile(h, 99.9));
+    writer_append_all(w, ",\"max_ns\":");
+    writer_append_int(w, h->max);
+    writer_append_char(w, '}');
+  }
+  pthread_mutex_unlock(&histograms_lock);
+  writer_append_all(w, "},\"counters\":{");
+  for (size_t i = 0; i < STAT_COUNTERS; i++) {
+    if (i > 0) writer_append_char(w, ',');
+    writer_append_char(w, '"');
+    writer_append_all(w, COUNTER_NAMES[i]);
+    writer_append_all(w, "\":");
+    writer_append_int(w, stats_counter(i));
+  }
+  writer_append_all(w, "}}\n");
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H_
+#define STATS_H_
+#include <stdint.h>
+#include "writer.h"
+
+/* Log-linear (HDR style) latency histogram: values below 2^SUB_BITS are
+   exact, above that every power of two is split into 2^SUB_BITS buckets,
+   so any recorded value is within ~3% of its bucket bound. */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_COUNT)
+#define STATS_MAX_HISTOGRAMS 64
+
+typedef struct {
+  const char *name;
+  uint64_t count;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef enum {
+  STAT_ALLOCS = 0,
+  STAT_ALLOC_BYTES,
+  STAT_BYTES_PARSED,
+  STAT_BOOKS_PARSED,
+  STAT_PERSIST_RECORDS,
+  STAT_PERSIST_BATCHES,
+  STAT_PERSIST_FSYNCS,
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES,
+  STAT_COUNTERS
+} stat_counter_t;
+
+uint64_t stats_now();
+
+void histogram_record(histogram_t *h, uint64_t value);
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+
+histogram_t *stats_histogram(const char *name);
+
+void stats_record(const char *name, uint64_t nanoseconds);
+
+void stats_record_since(const char *name, uint64_t start);
+
+void stats_count(stat_counter_t counter, uint64_t n);
+
+uint64_t stats_counter(stat_counter_t counter);
+
+void stats_print(writer_t *w);
+
+void stats_write_json(writer_t *w);
+
+#endif // STATS_H_
@@ -1,24 +1,39 @@
 #include "tree.h"
 #include "macros.h"
+#include "stats.h"
 #include "library.h"
+#include "postings.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 key_t key_from_string(string_t *s) {
   key_t k = { KEY_STRING, .key = s };
   return k;
 }
 
+key_t key_borrow_string(string_t *s) {
+  key_t k = { KEY_STRING, .borrowed = true, .key = s };
+  return k;
+}
+
 key_t key_from_int(int i) {
   key_t k = { KEY_INT, .ikey = i };
   return k;
 }
 
 void key_free(key_t k) {
-  if (k.type == KEY_STRING)
+  if (k.type == KEY_STRING && !k.borrowed)
     string_free(k.key);
 }
 
+key_t key_copy(const key_t *k) {
+  if (k->type == KEY_STRING && !k->borrowed)
+    return key_from_string(string_copy_alloc(k->key));
+  return *k;
+}
+
 void key_fprint(FILE *f, const key_t *k) {
   if (k == NULL) die("key pointer was null");
   if (k->type == KEY_STRING)
@@ -31,6 +46,14 @@ void key_print(const key_t *k) {
   key_fprint(stdout, k);
 }
 
+void key_write(const key_t *k, writer_t *w) {
+  if (k == NULL) die("key pointer was null");
+  if (k->type == KEY_STRING)
+    writer_append_string(w, k->key);
+  else
+    writer_append_int(w, k->ikey);
+}
+
 bool key_is_void(const key_t *key) {
   if (key->type == KEY_INT) return false;
   if (string_length(key->key) == 0) return true;
@@ -45,25 +68,83 @@ int key_comp(const key_t *k1, const key_t *k2) {
   return k1->ikey - k2->ikey;
 }
 
-avl_t *avl_alloc() {
-  avl_t *avl = calloc(1, sizeof(avl_t));
-  if (avl == NULL) die("out of memory");
-  avl->freefunc = nofree;
+avl_entry_t *avl_entry_alloc(key_t key, pool_t *pool) {
+  avl_entry_t *entry = pool_alloc(pool);
+  entry->refs = 1;
+  entry->key = key;
+  postings_init(&entry->books);
+  return entry;
+}
+
+void avl_entry_free(avl_entry_t *entry, pool_t *pool) {
+  if (entry == NULL || --entry->refs > 0) return;
+  key_free(entry->key);
+  postings_free(&entry->books);
+  pool_release(pool, entry);
+}
+
+avl_t *avl_alloc(pool_t *pool) {
+  avl_t *avl = pool_alloc(pool);
+  memset(avl, 0, sizeof(avl_t));
+  avl->refs = 1;
   return avl;
 }
 
-void avl_free(avl_t *avl) {
-  if (avl == NULL) return;
-  avl_free(avl->left);
-  avl_free(avl->right);
-  key_free(avl->key);
-  stack_free(avl->data, avl->freefunc);
-  free(avl);
+avl_t *avl_retain(avl_t *avl) {
+  if (avl != NULL) avl->refs++;
+  return avl;
+}
+
+// drops one reference, freeing the nodes no other tree shares
+void avl_free(avl_t *avl, pool_t *pool) {
+  if (avl == NULL || --avl->refs > 0) return;
+  avl_free(avl->left, pool);
+  avl_free(avl->right, pool);
+  avl_entry_free(avl->entry, pool);
+  pool_release(pool, avl);
+}
+
+/* Makes *node safe to change: a node shared with another tree is
+   replaced by a private copy that shares its children and entry. */
+avl_t *avl_own(avl_t **node, pool_t *pool) {
+  avl_t *avl = *node;
+  if (avl == NULL || avl->refs == 1) return avl;
+  avl_t *copy = avl_alloc(pool);
+  copy->left = avl_retain(avl->left);
+  copy->right = avl_retain(avl->right);
+  copy->height = avl->height;
+  copy->size = avl->size;
+  copy->entry = avl->entry;
+  copy->entry->refs++;
+  avl->refs--;
+  *node = copy;
+  return copy;
+}
+
+// same for the entry of an owned node; the books themselves are shared
+avl_entry_t *avl_own_entry(avl_t *avl, pool_t *pool) {
+  avl_entry_t *entry = avl->entry;
+  if (entry->refs == 1) return entry;
+  avl->entry = avl_entry_alloc(key_copy(&entry->key), pool);
+  avl->entry->books = postings_copy(&entry->books);
+  avl_entry_free(entry, pool);
+  return avl->entry;
+}
+
+// copies the path down to key, returning its now private node
+avl_t *avl_own_path(avl_t **root, const key_t *key, pool_t *pool) {
+  while (*root != NULL) {
+    avl_t *avl = avl_own(root, pool);
+    int comp = key_comp(key, &avl->entry->key);
+    if (comp == 0) return avl;
+    root = comp < 0 ? &avl->left : &avl->right;
+  }
+  return NULL;
 }
 
 uintptr_t avl_size(avl_t *avl) {
   if (avl == NULL) return 0;
-  return avl_size(avl->left) + 1 + avl_size(avl->right);
+  return avl->size;
 }
 
 void avl_print(const avl_t *avl) {
@@ -71,7 +152,7 @@ void avl_print(const avl_t *avl) {
   printf("(");
   avl_print(avl->left);
   if (avl->left) printf(" ");
-  key_print(&avl->key);
+  key_print(&avl->entry->key);
   if (avl->right) printf(" ");
   avl_print(avl->right);
   printf(")");
@@ -79,18 +160,18 @@ void avl_print(const avl_t *avl) {
 
 bool avl_contains(const avl_t *avl, const key_t *key) {
   if (avl == NULL) return false;
-  int comp = key_comp(key, &avl->key);
+  int comp = key_comp(key, &avl->entry->key);
   if (comp < 0) return avl_contains(avl->left, key);
   if (comp > 0) return avl_contains(avl->right, key);
   return true;
 }
 
-stack_t *avl_get(const avl_t *avl, const key_t *key) {
+const postings_t *avl_get(const avl_t *avl, const key_t *key) {
   if (avl == NULL) return NULL;
-  int comp = key_comp(key, &avl->key);
+  int comp = key_comp(key, &avl->entry->key);
   if (comp < 0) return avl_get(avl->left, key);
   if (comp > 0) return avl_get(avl->right, key);
-  return avl->data;
+  return &avl->entry->books;
 }
 
 uintptr_t avl_height(avl_t *avl) {
@@ -98,15 +179,17 @@ uintptr_t avl_height(avl_t *avl) {
   return avl->height;
 }
 
+// and the subtree size along with it
 void avl_update_height(avl_t *avl) {
   if (avl == NULL) return;
   avl->height = max(avl_height(avl->left), avl_height(avl->right)) + 1;
+  avl->size = avl_size(avl->left) + 1 + avl_size(avl->right);
 }
 
-avl_t *avl_rotate_right(avl_t *root) {
+avl_t *avl_rotate_right(avl_t *root, pool_t *pool) {
   if (root == NULL) die("avl_rotate_right(): invalid node");
   if (root->left == NULL) die("avl_rotate_right(): invalid rotate");
-  avl_t *newroot = root->left;
+  avl_t *newroot = avl_own(&root->left, pool);
   root->left = take(&newroot->right);
   avl_update_height(root);
   newroot->right = root;
@@ -114,10 +197,10 @@ avl_t *avl_rotate_right(avl_t *root) {
   return newroot;
 }
 
-avl_t *avl_rotate_left(avl_t *root) {
+avl_t *avl_rotate_left(avl_t *root, pool_t *pool) {
   if (root == NULL) die("avl_rotate_left(): invalid node");
   if (root->right == NULL) die("avl_rotate_left(): invalid rotate");
-  avl_t *newroot = root->right;
+  avl_t *newroot = avl_own(&root->right, pool);
   root->right = take(&newroot->left);
   avl_update_height(root);
   newroot->left = root;
@@ -125,143 +208,312 @@ avl_t *avl_rotate_left(avl_t *root) {
   return newroot;
 }
 
-avl_t *avl_rotate_left_node(avl_t *root) {
+avl_t *avl_rotate_left_node(avl_t *root, pool_t *pool) {
   if (root == NULL) die("avl_rotate_left_node(): invalid node");
   if (root->left == NULL) die("avl_rotate_right_node(): invalid rotate");
-  avl_t *left = root->left;
+  avl_t *left = avl_own(&root->left, pool);
   if (avl_height(left->left) < avl_height(left->right)) {
-    root->left = avl_rotate_left(left);
+    root->left = avl_rotate_left(left, pool);
     avl_update_height(root);
   }
-  return avl_rotate_right(root);
+  return avl_rotate_right(root, pool);
 }
 
-avl_t *avl_rotate_right_node(avl_t *root) {
+avl_t *avl_rotate_right_node(avl_t *root, pool_t *pool) {
   if (root == NULL) die("avl_rotate_left_node(): invalid node");
   if (root->right == NULL) die("avl_rotate_right_node(): invalid rotate");
-  avl_t *right = root->right;
+  avl_t *right = avl_own(&root->right, pool);
   if (avl_height(right->left) > avl_height(right->right)) {
-    root->right = avl_rotate_right(right);
+    root->right = avl_rotate_right(right, pool);
     avl_update_height(root);
   }
-  return avl_rotate_left(root);
+  return avl_rotate_left(root, pool);
 }
 
 int avl_left_minus_right(avl_t *avl) {
   return avl_height(avl->left) - avl_height(avl->right);
 }
 
-avl_t *avl_rotate_correctly(avl_t *root) {
+avl_t *avl_rotate_correctly(avl_t *root, pool_t *pool) {
   int diff = avl_left_minus_right(root);
   if (-1 <= diff && diff <= 1) return root;
-  if (diff ==  2) return avl_rotate_left_node(root);
-  if (diff == -2) return avl_rotate_right_node(root);
+  if (diff ==  2) return avl_rotate_left_node(root, pool);
+  if (diff == -2) return avl_rotate_right_node(root, pool);
   die("avl_rotate_correctly(): invalid tree balance");
   return NULL;
 }
 
-void avl_update_node(avl_t **root) {
+void avl_update_node(avl_t **root, pool_t *pool) {
   if (root == NULL) die("avl_update_node(): root is NULL");
-  *root = avl_rotate_correctly(*root);
+  *root = avl_rotate_correctly(*root, pool);
   avl_update_height(*root);
 }
 
-void avl_add(avl_t **root, key_t key, void *v, void(*freefunc)(void *)) {
+// ids maps the ids of large buckets back to books
+void avl_add(avl_t **root, key_t key, booknode_t *bn, pool_t *pool, const booktable_t *ids) {
   if (root == NULL) die("avl root was null");
   if (key_is_void(&key)) {
     key_free(key);
-    freefunc(v);
     return;
   }
   if (*root == NULL) {
-    *root = avl_alloc();
-    (*root)->key = key;
-    (*root)->data = stack_init(1);
-    stack_push((*root)->data, v);
+    *root = avl_alloc(pool);
+    (*root)->entry = avl_entry_alloc(key, pool);
+    postings_add(&(*root)->entry->books, bn, ids);
     (*root)->height = 1;
-    (*root)->freefunc = freefunc;
+    (*root)->size = 1;
     return;
   }
-  avl_t *avl = *root;
-  int diff = key_comp(&key, &avl->key);
+  avl_t *avl = avl_own(root, pool);
+  int diff = key_comp(&key, &avl->entry->key);
   if (diff == 0) {
-    key_free(avl->key);
-    avl->key = key;
-    stack_push(avl->data, v);
+    avl_entry_t *entry = avl_own_entry(avl, pool);
+    key_free(entry->key);
+    entry->key = key;
+    postings_add(&entry->books, bn, ids);
     return;
   }
   if (diff > 0)
-    avl_add(&avl->right, key, v, freefunc);
+    avl_add(&avl->right, key, bn, pool, ids);
   else
-    avl_add(&avl->left, key, v, freefunc);
-  avl_update_node(root);
+    avl_add(&avl->left, key, bn, pool, ids);
+  avl_update_node(root, pool);
   return;
 }
 
-avl_t *drop_min_from_left(avl_t **root, avl_t *left) {
-  (*root)->left = avl_drop_min(&left);
+avl_t *drop_min_from_left(avl_t **root, avl_t *left, pool_t *pool) {
+  (*root)->left = avl_drop_min(&left, pool);
   avl_t *oldroot = *root;
   *root = left;
-  avl_update_node(&oldroot);
+  avl_update_node(&oldroot, pool);
   return oldroot;
 }
 
-avl_t *avl_drop_min(avl_t **root) {
+avl_t *avl_drop_min(avl_t **root, pool_t *pool) {
+  avl_own(root, pool);
   avl_t *left = take(&(*root)->left);
   if (left == NULL)
     return take(&(*root)->right);
-  return drop_min_from_left(root, left);
+  return drop_min_from_left(root, left, pool);
 }
 
-avl_t *avl_combine_branches(avl_t *l, avl_t *r) {
+avl_t *avl_combine_branches(avl_t *l, avl_t *r, pool_t *pool) {
   if (l == NULL) return r;
   if (r == NULL) return l;
-  avl_t *trunc_right = avl_drop_min(&r);
+  avl_t *trunc_right = avl_drop_min(&r, pool);
   r->left = l;
   r->right = trunc_right;
-  avl_update_node(&r);
+  avl_update_node(&r, pool);
   return r;
 }
 
-avl_t *avl_remove_node(avl_t **root, const key_t *key) {
+avl_t *avl_remove_node(avl_t **root, const key_t *key, pool_t *pool) {
   if (root == NULL) die("avl root was null");
   if (*root == NULL) return NULL;
-  avl_t *avl = *root;
-  int diff = key_comp(key, &avl->key);
+  avl_t *avl = avl_own(root, pool);
+  int diff = key_comp(key, &avl->entry->key);
   if (diff == 0) {
-    *root = avl_combine_branches(take(&avl->left), take(&avl->right));
+    *root = avl_combine_branches(take(&avl->left), take(&avl->right), pool);
     return avl;
   }
   if (diff > 0)
-    avl = avl_remove_node(&avl->right, key);
+    avl = avl_remove_node(&avl->right, key, pool);
   else
-    avl = avl_remove_node(&avl->left, key);
-  avl_update_node(root);
+    avl = avl_remove_node(&avl->left, key, pool);
+  avl_update_node(root, pool);
   return avl;
 }
 
-void *avl_remove(avl_t **avl, const key_t *key) {
+// removes the book added last under key, and the key with its last book
+booknode_t *avl_remove(avl_t **avl, const key_t *key, pool_t *pool) {
   if (avl == NULL) die("avl root was null");
-  stack_t *target = avl_get(*avl, key);
+  const postings_t *target = avl_get(*avl, key);
   if (target == NULL) return NULL;
-  if (target->size > 1) {
-    return stack_pop(target);
-  }
-  avl_t *node = avl_remove_node(avl, key);
+  if (postings_size(target) > 1)
+    return postings_pop(&avl_own_entry(avl_own_path(avl, key, pool), pool)->books);
+  avl_t *node = avl_remove_node(avl, key, pool);
   if (node == NULL) return NULL;
-  void *data = stack_pop(node->data);
-  avl_free(node);
-  return data;
+  postings_iter_t it;
+  postings_iter_init(&it, &node->entry->books);
+  booknode_t *bn = postings_next(&it);
+  avl_free(node, pool);
+  return bn;
 }
 
 int avl_walk(avl_t *avl, avl_walkfunc_t walkfunc, void *state) {
   if (avl == NULL) return 0;
   RET_IF(avl_walk(avl->left, walkfunc, state));
-  RET_IF(walkfunc(&avl->key, avl->data, state));
+  RET_IF(walkfunc(&avl->entry->key, &avl->entry->books, state));
   return avl_walk(avl->right, walkfunc, state);
 }
 
-int avl_print_list_walkfunc(const key_t *key, stack_t *data, void *file) {
+typedef struct {
+  avl_walkfunc_t walkfunc;
+  void *state;
+  size_t skip;
+  size_t remaining;
+  bool descending;
+} avl_range_t;
+
+int avl_walk_range_node(avl_t *avl, avl_range_t *range) {
+  if (avl == NULL || range->remaining == 0) return 0;
+  // whole subtrees before the offset are skipped by their size
+  if (range->skip >= avl->size) {
+    range->skip -= avl->size;
+    return 0;
+  }
+  RET_IF(avl_walk_range_node(range->descending ? avl->right : avl->left, range));
+  if (range->remaining == 0) return 0;
+  if (range->skip > 0) {
+    range->skip--;
+  } else {
+    range->remaining--;
+    RET_IF(range->walkfunc(&avl->entry->key, &avl->entry->books, range->state));
+  }
+  return avl_walk_range_node(range->descending ? avl->left : avl->right, range);
+}
+
+/* Walks limit entries (all with 0) from the offset-th on, in key order
+   or in reverse. Reaching the offset costs O(log n) and the walk stops
+   as soon as the last entry is visited. */
+int avl_walk_range(avl_t *avl, size_t offset, size_t limit, bool descending, avl_walkfunc_t walkfunc, void *state) {
+  avl_range_t range = { walkfunc, state, offset, limit == 0 ? SIZE_MAX : limit, descending };
+  return avl_walk_range_node(avl, &range);
+}
+
+int avl_walk_prefix(avl_t *avl, const string_t *prefix, avl_walkfunc_t walkfunc, void *state) {
+  if (avl == NULL) return 0;
+  if (avl->entry->key.type != KEY_STRING) die("avl_walk_prefix(): key type error");
+  int comp = string_prefix_comp(avl->entry->key.key, prefix);
+  if (comp < 0) return avl_walk_prefix(avl->right, prefix, walkfunc, state);
+  if (comp > 0) return avl_walk_prefix(avl->left, prefix, walkfunc, state);
+  RET_IF(avl_walk_prefix(avl->left, prefix, walkfunc, state));
+  RET_IF(walkfunc(&avl->entry->key, &avl->entry->books, state));
+  return avl_walk_prefix(avl->right, prefix, walkfunc, state);
+}
+
+/* A fuzzy walk runs the Levenshtein automaton of the query over the
+   index instead of measuring every key. Its state after reading a
+   prefix is the row of edit distances from that prefix to each prefix
+   of the query; the automaton is dead once every distance in the row
+   is over the bound. Every key in a subtree lies between the keys of
+   its nearest ancestors on either side and so starts with their common
+   prefix: when the automaton dies on that prefix the whole subtree is
+   skipped, which keeps the walk to the few branches near the query. */
+
+typedef struct {
+  avl_entry_t *entry;
+  size_t distance;
+  size_t order;
+} fuzzy_match_t;
+
+typedef struct {
+  byte_t *query;
+  size_t len;
+  size_t distance;
+  // row i holds the distances from the first i bytes read
+  size_t *rows;
+  size_t capacity;
+  fuzzy_match_t *matches;
+  size_t size;
+  size_t allocated;
+} avl_fuzzy_t;
+
+size_t *fuzzy_row(avl_fuzzy_t *fz, size_t i) {
+  if (i >= fz->capacity) {
+    size_t capacity = max(2 * fz->capacity, i + 1);
+    size_t *rows = realloc(fz->rows, capacity * (fz->len + 1) * sizeof(size_t));
+    if (rows == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+    stats_count(STAT_ALLOC_BYTES, (capacity - fz->capacity) * (fz->len + 1) * sizeof(size_t));
+    fz->rows = rows;
+    fz->capacity = capacity;
+  }
+  return fz->rows + i * (fz->len + 1);
+}
+
+// steps the automaton from row i - 1 over byte b, false once it is dead
+bool fuzzy_step(avl_fuzzy_t *fz, size_t i, byte_t b) {
+  size_t *row = fuzzy_row(fz, i);
+  const size_t *prev = fuzzy_row(fz, i - 1);
+  b = toupper(b);
+  row[0] = i;
+  size_t best = row[0];
+  for (size_t j = 1; j <= fz->len; j++) {
+    size_t cost = prev[j - 1] + (fz->query[j - 1] != b);
+    row[j] = min(cost, min(prev[j], row[j - 1]) + 1);
+    best = min(best, row[j]);
+  }
+  return best <= fz->distance;
+}
+
+// the length of the prefix every key between lo and hi starts with
+size_t fuzzy_common_prefix(const string_t *lo, const string_t *hi) {
+  if (lo == NULL || hi == NULL) return 0;
+  size_t i = 0;
+  while (i < lo->len && i < hi->len && toupper(lo->value[i]) == toupper(hi->value[i])) i++;
+  return i;
+}
+
+void fuzzy_match(avl_fuzzy_t *fz, avl_entry_t *entry, size_t distance) {
+  if (fz->size == fz->allocated) {
+    fz->allocated = max(2 * fz->allocated, 16);
+    fz->matches = realloc(fz->matches, fz->allocated * sizeof(fuzzy_match_t));
+    if (fz->matches == NULL) die("out of memory");
+    stats_count(STAT_ALLOCS, 1);
+  }
+  fz->matches[fz->size] = (fuzzy_match_t){ entry, distance, fz->size };
+  fz->size++;
+}
+
+// done rows are already filled in from the prefix shared with the parent
+void avl_walk_fuzzy_node(avl_t *avl, avl_fuzzy_t *fz, const string_t *lo, const string_t *hi, size_t done) {
+  if (avl == NULL) return;
+  const string_t *key = avl->entry->key.key;
+  size_t shared = fuzzy_common_prefix(lo, hi);
+  for (; done < shared; done++)
+    if (!fuzzy_step(fz, done + 1, key->value[done])) return;
+  // the children only write the rows past the shared prefix
+  avl_walk_fuzzy_node(avl->left, fz, lo, key, shared);
+  size_t i = shared;
+  while (i < key->len && fuzzy_step(fz, i + 1, key->value[i])) i++;
+  if (i == key->len && fuzzy_row(fz, i)[fz->len] <= fz->distance)
+    fuzzy_match(fz, avl->entry, fuzzy_row(fz, i)[fz->len]);
+  avl_walk_fuzzy_node(avl->right, fz, key, hi, shared);
+}
+
+int fuzzy_match_comp(const void *m1, const void *m2) {
+  const fuzzy_match_t *a = m1, *b = m2;
+  if (a->distance != b->distance) return a->distance < b->distance ? -1 : 1;
+  return a->order < b->order ? -1 : a->order > b->order;
+}
+
+/* Calls walkfunc on every entry within distance edits (insertions,
+   deletions and substitutions of bytes, ignoring case) of query,
+   closest first and in key order among equally close ones. */
+int avl_walk_fuzzy(avl_t *avl, const string_t *query, size_t distance, avl_walkfunc_t walkfunc, void *state) {
+  if (avl == NULL) return 0;
+  if (avl->entry->key.type != KEY_STRING) die("avl_walk_fuzzy(): key type error");
+  avl_fuzzy_t fz = { NULL, string_length(query), distance, NULL, 0, NULL, 0, 0 };
+  fz.query = malloc(fz.len + 1);
+  if (fz.query == NULL) die("out of memory");
+  stats_count(STAT_ALLOCS, 1);
+  stats_count(STAT_ALLOC_BYTES, fz.len + 1);
+  for (size_t j = 0; j < fz.len; j++) fz.query[j] = toupper(query->value[j]);
+  size_t *row = fuzzy_row(&fz, 0);
+  for (size_t j = 0; j <= fz.len; j++) row[j] = j;
+  avl_walk_fuzzy_node(avl, &fz, NULL, NULL, 0);
+  if (fz.size > 1) qsort(fz.matches, fz.size, sizeof(fuzzy_match_t), fuzzy_match_comp);
+  int err = 0;
+  for (size_t m = 0; m < fz.size && err == 0; m++)
+    err = walkfunc(&fz.matches[m].entry->key, &fz.matches[m].entry->books, state);
+  free(fz.matches);
+  free(fz.rows);
+  free(fz.query);
+  return err;
+}
+
+int avl_print_list_walkfunc(const key_t *key, const postings_t *books, void *file) {
   FILE *f;
   if (file != NULL) f = file;
   else              f = stdout;
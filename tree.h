@@ -3,23 +3,41 @@
 #include "library.h"
 #include <stdint.h>
 
-typedef int (*avl_walkfunc_t)(const key_t *k, stack_t *d, void *state);
-
 key_t key_from_string(string_t *s);
 
+key_t key_borrow_string(string_t *s);
+
 key_t key_from_int(int i);
 
 void key_free(key_t k);
 
+key_t key_copy(const key_t *k);
+
 void key_fprint(FILE *f, const key_t *k);
 
 void key_print(const key_t *k);
 
+void key_write(const key_t *k, writer_t *w);
+
+int key_comp(const key_t *k1, const key_t *k2);
+
 bool key_is_void(const key_t *key);
 
-avl_t *avl_alloc();
+avl_entry_t *avl_entry_alloc(key_t key, pool_t *pool);
+
+void avl_entry_free(avl_entry_t *entry, pool_t *pool);
+
+avl_t *avl_alloc(pool_t *pool);
 
-void avl_free(avl_t *avl);
+avl_t *avl_retain(avl_t *avl);
+
+void avl_free(avl_t *avl, pool_t *pool);
+
+avl_t *avl_own(avl_t **node, pool_t *pool);
+
+avl_entry_t *avl_own_entry(avl_t *avl, pool_t *pool);
+
+avl_t *avl_own_path(avl_t **root, const key_t *key, pool_t *pool);
 
 uintptr_t avl_size(avl_t *avl);
 
@@ -27,40 +45,46 @@ void avl_print(const avl_t *avl);
 
 bool avl_contains(const avl_t *avl, const key_t *key);
 
-stack_t *avl_get(const avl_t *avl, const key_t *key);
+const postings_t *avl_get(const avl_t *avl, const key_t *key);
 
 uintptr_t avl_height(avl_t *avl);
 
 void avl_update_height(avl_t *avl);
 
-avl_t *avl_rotate_right(avl_t *root);
+avl_t *avl_rotate_right(avl_t *root, pool_t *pool);
 
-avl_t *avl_rotate_left(avl_t *root);
+avl_t *avl_rotate_left(avl_t *root, pool_t *pool);
 
-avl_t *avl_rotate_left_node(avl_t *root);
+avl_t *avl_rotate_left_node(avl_t *root, pool_t *pool);
 
-avl_t *avl_rotate_right_node(avl_t *root);
+avl_t *avl_rotate_right_node(avl_t *root, pool_t *pool);
 
 int avl_left_minus_right(avl_t *avl);
 
-avl_t *avl_rotate_correctly(avl_t *root);
+avl_t *avl_rotate_correctly(avl_t *root, pool_t *pool);
 
 avl_t *avl_updated_node(avl_t *root);
 
-void avl_add(avl_t **avl, key_t k, void *v, void(*freefunc)(void *));
+void avl_add(avl_t **avl, key_t k, booknode_t *bn, pool_t *pool, const booktable_t *ids);
 
-avl_t *drop_min_from_left(avl_t **root, avl_t *left);
+avl_t *drop_min_from_left(avl_t **root, avl_t *left, pool_t *pool);
 
-avl_t *avl_drop_min(avl_t **root);
+avl_t *avl_drop_min(avl_t **root, pool_t *pool);
 
-avl_t *avl_combine_branches(avl_t *l, avl_t *r);
+avl_t *avl_combine_branches(avl_t *l, avl_t *r, pool_t *pool);
 
-avl_t *avl_remove_node(avl_t **root, const key_t *key);
+avl_t *avl_remove_node(avl_t **root, const key_t *key, pool_t *pool);
 
-void *avl_remove(avl_t **avl, const key_t *key);
+booknode_t *avl_remove(avl_t **avl, const key_t *key, pool_t *pool);
 
 int avl_walk(avl_t *avl, avl_walkfunc_t walkfunc, void *state);
 
-int avl_print_list_walkfunc(const key_t *key, stack_t *data, void *file);
+int avl_walk_range(avl_t *avl, size_t offset, size_t limit, bool descending, avl_walkfunc_t walkfunc, void *state);
+
+int avl_walk_prefix(avl_t *avl, const string_t *prefix, avl_walkfunc_t walkfunc, void *state);
+
+int avl_walk_fuzzy(avl_t *avl, const string_t *query, size_t distance, avl_walkfunc_t walkfunc, void *state);
+
+int avl_print_list_walkfunc(const key_t *key, const postings_t *books, void *file);
 
 #endif // TREE_H_
@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L
+#include "writer.h"
+#include "macros.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+writer_t *writer_alloc(FILE *f, persist_t *p, size_t capacity) {
+  if (capacity == 0) capacity = WRITER_DEFAULT_CAPACITY;
+  writer_t *w = malloc(sizeof(writer_t));
+  if (w == NULL) die("out of memory");
+  w->buffer = malloc(capacity * sizeof(byte_t));
+  if (w->buffer == NULL) die("out of memory");
+  w->file = f;
+  w->fd = -1;
+  w->persist = p;
+  w->len = 0;
+  w->capacity = capacity;
+  w->total = 0;
+  w->error = false;
+  clock_gettime(CLOCK_MONOTONIC, &w->start);
+  return w;
+}
+
+writer_t *writer_init(FILE *f, size_t capacity) {
+  if (f == NULL) die("writer_init(): file was null");
+  return writer_alloc(f, NULL, capacity);
+}
+
+// every flush becomes one record for the persistence thread
+writer_t *writer_init_persist(persist_t *p, size_t capacity) {
+  if (p == NULL) die("writer_init_persist(): persist was null");
+  return writer_alloc(NULL, p, capacity);
+}
+
+/* Output through write(2) alone, with no stdio or allocation behind
+   it, so a forked child of a multithreaded process can use it. */
+writer_t *writer_init_fd(int fd, size_t capacity) {
+  if (fd < 0) die("writer_init_fd(): file descriptor was invalid");
+  writer_t *w = writer_alloc(NULL, NULL, capacity);
+  w->fd = fd;
+  return w;
+}
+
+void writer_output_fd(writer_t *w, const byte_t *src, size_t n) {
+  while (n > 0) {
+    ssize_t done = write(w->fd, src, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) {
+      w->error = true;
+      return;
+    }
+    src += done;
+    n -= done;
+  }
+}
+
+void writer_output(writer_t *w, const void *src, size_t n) {
+  if (w->persist != NULL)
+    persist_push(w->persist, src, n);
+  else if (w->fd >= 0)
+    writer_output_fd(w, src, n);
+  else if (fwrite(src, sizeof(byte_t), n, w->file) != n)
+    w->error = true;
+}
+
+int writer_flush(writer_t *w) {
+  if (w == NULL) die("writer_flush(): writer was null");
+  if (w->len > 0) {
+    writer_output(w, w->buffer, w->len);
+    w->len = 0;
+  }
+  if (w->persist != NULL) {
+    if (persist_error(w->persist)) w->error = true;
+  } else if (w->fd < 0 && fflush(w->file) != 0) {
+    w->error = true;
+  }
+  return w->error;
+}
+
+int writer_free(writer_t *w) {
+  if (w == NULL) return 0;
+  int err = writer_flush(w);
+  free(w->buffer);
+  free(w);
+  return err;
+}
+
+void writer_append_n(writer_t *w, const void *src, size_t n) {
+  if (w == NULL) die("writer_append_n(): writer was null");
+  w->total += n;
+  if (w->len + n > w->capacity) {
+    if (w->len > 0) writer_output(w, w->buffer, w->len);
+    w->len = 0;
+    // too big to be worth buffering, hand it over in one piece
+    if (n >= w->capacity) {
+      writer_output(w, src, n);
+      return;
+    }
+  }
+  memcpy(w->buffer + w->len, src, n);
+  w->len += n;
+}
+
+void writer_append_all(writer_t *w, const char *src) {
+  writer_append_n(w, src, strlen(src));
+}
+
+void writer_append_char(writer_t *w, char c) {
+  if (w->len == w->capacity) {
+    writer_append_n(w, &c, 1);
+    return;
+  }
+  w->buffer[w->len++] = c;
+  w->total++;
+}
+
+void writer_append_string(writer_t *w, const string_t *s) {
+  if (string_length(s) == 0) return;
+  writer_append_n(w, s->value, s->len);
+}
+
+void writer_append_int(writer_t *w, long i) {
+  char buf[24];
+  char *b = buf + sizeof(buf);
+  unsigned long u = i < 0 ? -(unsigned long)i : (unsigned long)i;
+  do {
+    *--b = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (i < 0) *--b = '-';
+  writer_append_n(w, b, buf + sizeof(buf) - b);
+}
+
+// JSON string contents without the quotes, UTF-8 is passed through untouched
+void writer_append_json_escaped(writer_t *w, const string_t *s) {
+  static const char HEX[] = "0123456789abcdef";
+  size_t len = string_length(s);
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    byte_t b = s->value[i];
+    if (b >= 0x20 && b != '"' && b != '\\') continue;
+    writer_append_n(w, s->value + run, i - run);
+    run = i + 1;
+    writer_append_char(w, '\\');
+    switch (b) {
+    case '"':  writer_append_char(w, '"'); break;
+    case '\\': writer_append_char(w, '\\'); break;
+    case '\n': writer_append_char(w, 'n'); break;
+    case '\t': writer_append_char(w, 't'); break;
+    case '\r': writer_append_char(w, 'r'); break;
+    default:
+      writer_append_all(w, "u00");
+      writer_append_char(w, HEX[b >> 4]);
+      writer_append_char(w, HEX[b & 0xF]);
+    }
+  }
+  if (len > run) writer_append_n(w, s->value + run, len - run);
+}
+
+void writer_append_json_string(writer_t *w, const string_t *s) {
+  writer_append_char(w, '"');
+  writer_append_json_escaped(w, s);
+  writer_append_char(w, '"');
+}
+
+// tab separated value field with tabs, newlines and backslashes escaped
+void writer_append_tsv_field(writer_t *w, const string_t *s) {
+  size_t len = string_length(s);
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    byte_t b = s->value[i];
+    if (b != '\t' && b != '\n' && b != '\r' && b != '\\') continue;
+    writer_append_n(w, s->value + run, i - run);
+    run = i + 1;
+    writer_append_char(w, '\\');
+    writer_append_char(w, b == '\t' ? 't' : b == '\n' ? 'n' : b == '\r' ? 'r' : '\\');
+  }
+  if (len > run) writer_append_n(w, s->value + run, len - run);
+}
+
+// the inside of a quoted CSV field: quotes are doubled, all else is kept
+void writer_append_csv_escaped(writer_t *w, const string_t *s) {
+  size_t len = string_length(s);
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s->value[i] != '"') continue;
+    writer_append_n(w, s->value + run, i + 1 - run);
+    writer_append_char(w, '"');
+    run = i + 1;
+  }
+  if (len > run) writer_append_n(w, s->value + run, len - run);
+}
+
+// RFC 4180 field, quoted only if it holds a comma, quote or line break
+void writer_append_csv_field(writer_t *w, const string_t *s) {
+  size_t len = string_length(s);
+  bool quote = false;
+  for (size_t i = 0; i < len && !quote; i++)
+    quote = s->value[i] == ',' || s->value[i] == '"' || s->value[i] == '\n' || s->value[i] == '\r';
+  if (!quote) {
+    writer_append_string(w, s);
+    return;
+  }
+  writer_append_char(w, '"');
+  writer_append_csv_escaped(w, s);
+  writer_append_char(w, '"');
+}
+
+size_t writer_bytes(const writer_t *w) {
+  if (w == NULL) return 0;
+  return w->total;
+}
+
+double writer_seconds(const writer_t *w) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - w->start.tv_sec) + (now.tv_nsec - w->start.tv_nsec) / 1e9;
+}
+
+double writer_rate(const writer_t *w) {
+  double seconds = writer_seconds(w);
+  if (seconds <= 0) return 0;
+  return w->total / seconds;
+}
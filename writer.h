@@ -0,0 +1,61 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+#include "better_string.h"
+#include "persist.h"
+#include <time.h>
+
+#define WRITER_DEFAULT_CAPACITY (1 << 16)
+
+/*! Buffered output: bytes are appended to a large user-space buffer and
+  handed to the underlying FILE in one call when it fills or is flushed,
+  written straight to a file descriptor, or queued for a persistence
+  thread when the writer has one. */
+typedef struct {
+  FILE *file;
+  int fd;
+  persist_t *persist;
+  byte_t *buffer;
+  size_t len;
+  size_t capacity;
+  size_t total;
+  bool error;
+  struct timespec start;
+} writer_t;
+
+writer_t *writer_init(FILE *f, size_t capacity);
+
+writer_t *writer_init_persist(persist_t *p, size_t capacity);
+
+writer_t *writer_init_fd(int fd, size_t capacity);
+
+int writer_flush(writer_t *w);
+
+int writer_free(writer_t *w);
+
+void writer_append_n(writer_t *w, const void *src, size_t n);
+
+void writer_append_all(writer_t *w, const char *src);
+
+void writer_append_char(writer_t *w, char c);
+
+void writer_append_string(writer_t *w, const string_t *s);
+
+void writer_append_int(writer_t *w, long i);
+
+void writer_append_json_escaped(writer_t *w, const string_t *s);
+
+void writer_append_json_string(writer_t *w, const string_t *s);
+
+void writer_append_tsv_field(writer_t *w, const string_t *s);
+
+void writer_append_csv_escaped(writer_t *w, const string_t *s);
+
+void writer_append_csv_field(writer_t *w, const string_t *s);
+
+size_t writer_bytes(const writer_t *w);
+
+double writer_seconds(const writer_t *w);
+
+double writer_rate(const writer_t *w);
+
+#endif // WRITER_H_